@@ -1,5 +1,96 @@
 #include "slp.hpp"
 
+#define DEBUG_TYPE "slp"
+
+STATISTIC(NumPeakLiveVectors,
+          "Largest estimated number of vectors live at once in a block");
+STATISTIC(NumHighPressureBlocks,
+          "Number of blocks left scalar for lack of vector registers");
+STATISTIC(NumTrimmedPacks, "Number of packs dropped to fit the vector "
+                           "registers");
+STATISTIC(NumReductions, "Number of horizontal reductions of packs");
+STATISTIC(NumAlignedGlobals,
+          "Number of internal globals aligned for their vector accesses");
+STATISTIC(NumColdBlocks, "Number of cold blocks analyzed with less effort");
+STATISTIC(NumSkippedBlocks,
+          "Number of blocks not analyzed for their size or the budget");
+STATISTIC(NumPlanCacheHits, "Number of blocks whose plan was found on disk");
+STATISTIC(NumPlanCacheMisses,
+          "Number of blocks analyzed and whose plan was written to disk");
+
+// Guards state shared by the whole LLVMContext (uniqued constants and types)
+// while functions are analyzed in parallel
+static std::mutex contextLock;
+
+// Serializes the writes to the plan cache of functions analyzed in parallel
+static std::mutex planCacheLock;
+
+static cl::opt<unsigned int>
+    SLPThreads("slp-threads", cl::init(0), cl::Hidden,
+               cl::desc("Number of threads used by -passes=slp-parallel "
+                        "(0 = one per hardware thread)"));
+
+static cl::opt<unsigned int> SLPMaxRounds(
+    "slp-max-rounds", cl::init(1), cl::Hidden,
+    cl::desc("Maximum number of SLP rounds per basic block; later rounds "
+             "re-analyze the vectorized block until nothing changes. Only "
+             "scalars left over by earlier rounds are packed, vectors built "
+             "by an earlier round are not repacked"));
+
+static cl::opt<unsigned int>
+    SLPVectorBits("slp-vector-bits", cl::init(128), cl::Hidden,
+                  cl::desc("Width of a vector register in bits; longer pack "
+                           "chains are cut to fit"));
+
+static cl::opt<unsigned int>
+    SLPMaxStride("slp-max-stride", cl::init(4), cl::Hidden,
+                 cl::desc("Largest stride, in elements, of the interleaved "
+                          "memory accesses that are packed"));
+
+static cl::opt<unsigned int> SLPExactSelectLimit(
+    "slp-exact-select-limit", cl::init(16), cl::Hidden,
+    cl::desc("Select packs exactly in blocks with at most this many candidate "
+             "pairs"));
+
+static cl::opt<unsigned int> SLPMaxBlockSize(
+    "slp-max-block-size", cl::init(2000), cl::Hidden,
+    cl::desc("Blocks with more instructions are not analyzed"));
+
+static cl::opt<unsigned int> SLPColdBlockSize(
+    "slp-cold-block-size", cl::init(200), cl::Hidden,
+    cl::desc("Cold blocks with more instructions are not analyzed"));
+
+static cl::opt<unsigned int> SLPMaxPairs(
+    "slp-max-pairs", cl::init(4096), cl::Hidden,
+    cl::desc("Maximum number of candidate pairs explored per block"));
+
+static cl::opt<unsigned int> SLPFunctionBudget(
+    "slp-function-budget", cl::init(20000), cl::Hidden,
+    cl::desc("Instructions analyzed per function, hottest blocks first; "
+             "colder blocks past the budget stay scalar (0 = no limit)"));
+
+static cl::opt<unsigned int> SLPVectorRegisters(
+    "slp-vector-registers", cl::init(0), cl::Hidden,
+    cl::desc("Number of vector registers; blocks whose vectors would not fit "
+             "stay scalar (0 = ask the target)"));
+
+static cl::opt<unsigned int> SLPUnrollAndJamCount(
+    "slp-unroll-and-jam-count", cl::init(0), cl::Hidden,
+    cl::desc("Number of outer loop iterations jammed into the inner loop by "
+             "-passes=slp-unroll-and-jam (0 = as many elements as a vector "
+             "register holds)"));
+
+static cl::opt<unsigned int> SLPMaxAliasChecks(
+    "slp-max-alias-checks", cl::init(8), cl::Hidden,
+    cl::desc("Maximum number of runtime overlap checks guarding a vectorized "
+             "block; blocks that need more stay scalar"));
+
+static cl::opt<std::string> SLPPlanCacheDir(
+    "slp-plan-cache-dir", cl::init(""), cl::Hidden,
+    cl::desc("Directory where the plan of every analyzed block is kept, so "
+             "that an unchanged block is not analyzed again by a later "
+             "build (empty = no cache)"));
+
 Value *Pack::getOperand(unsigned int n, PackSet &P) {
   assert(pack.size() > 0);
   assert(n < pack[0]->getNumOperands());
@@ -9,361 +100,3039 @@ Value *Pack::getOperand(unsigned int n, PackSet &P) {
   return p->getValue();
 }
 
-class SLP : public FunctionPass {
+/*
+ * SLP extraction over the basic blocks of one function. The legacy and the new
+ * pass manager passes at the bottom of this file are thin wrappers around it.
+ *
+ * An SLP object is the per-function context: it owns all of the analysis
+ * state (alignment information and the pack plan of every block), and the
+ * analysis phase only reads the IR. Distinct functions can therefore be
+ * analyzed concurrently, as long as their plans are committed one at a time.
+ */
+class SLP {
 public:
-  static char ID;
-  SLP() : FunctionPass(ID) {}
+  SLP(Function &F, TargetLibraryInfo *TLI, TargetTransformInfo *TTI,
+      ScalarEvolution *SE, AAResults *AA, DominatorTree *DT, LoopInfo *LI,
+      BlockFrequencyInfo *BFI, ProfileSummaryInfo *PSI,
+      OptimizationRemarkEmitter *ORE)
+      : F(F), DL(F.getParent()->getDataLayout()), TLI(TLI), TTI(TTI), SE(SE),
+        AA(AA), DT(DT), LI(LI), BFI(BFI), PSI(PSI), ORE(ORE),
+        log(logBuffer) {}
   ~SLP() {}
 
-  // We modify the program within each basic block, but preserve the CFG
-  void getAnalysisUsage(AnalysisUsage &AU) const override {
-    AU.setPreservesCFG();
-  }
-
-  bool doInitialization(Module &M) override {
-    return false;
-  }
-
   // Apply transforms and print summary
-  bool runOnFunction(Function &F) override {
-    outs() << "-----" << F.getName() << "-----\n\n";
+  bool runOnFunction() {
+    bool prepared = prepare();
+    analyze();
+    return commit() || prepared;
+  }
 
+  /*
+   * Preparation phase: rewrite the min, max and absolute value idioms of F,
+   * compare and select sequences or libm calls, as the equivalent intrinsic
+   * calls, so that their lanes are isomorphic and packed like any other
+   * intrinsic. This modifies the IR, so like commit() it must not run
+   * concurrently with any other function. Returns whether F changed.
+   */
+  bool prepare() {
     bool changed = false;
+    for (auto &BB : F) {
+      for (auto iter = BB.begin(); iter != BB.end();) {
+        Instruction *s = &*iter++;
+        Value *idiom = nullptr;
+        if (auto select = dyn_cast<SelectInst>(s)) {
+          idiom = matchMinMaxAbs(select);
+        } else if (auto call = dyn_cast<CallInst>(s)) {
+          idiom = matchLibCall(call);
+        }
+        if (idiom == nullptr) {
+          continue;
+        }
+
+        if (verbose)
+          logs() << "[prepare] (" << *s << ") as (" << *idiom << ")\n";
+        idiom->takeName(s);
+        s->replaceAllUsesWith(idiom);
+        // the compare, and the negation of abs, are left dead
+        SmallVector<WeakTrackingVH, 4> operands(s->op_begin(), s->op_end());
+        s->eraseFromParent();
+        RecursivelyDeleteTriviallyDeadInstructionsPermissive(operands, TLI);
+        changed = true;
+      }
+    }
+    return changed;
+  }
 
+  /*
+   * Analysis phase: find, select, combine and schedule the packs of every
+   * basic block without modifying the IR.
+   *
+   * Blocks are analyzed from the hottest to the coldest, until the
+   * instructions analyzed exceed the budget of the function. Cold blocks
+   * get less effort (see coldBlock), and blocks too large for the effort
+   * they get are skipped.
+   */
+  void analyze() {
+    logs() << "-----" << F.getName() << "-----\n\n";
+    std::vector<BasicBlock *> blocks;
     for (auto &BB : F) {
-      baseAddress.clear();
-      alignInfo.clear();
-      changed |= slpExtract(BB);
+      blocks.push_back(&BB);
     }
+    std::stable_sort(blocks.begin(), blocks.end(),
+                     [&](BasicBlock *a, BasicBlock *b) {
+                       return BFI->getBlockFreq(a) > BFI->getBlockFreq(b);
+                     });
 
-    if (changed)
-      outs() << F.getName() << " SLP completed\n";
-    outs() << "\n";
-    return changed;
+    unsigned int analyzed = 0;
+    for (auto BB : blocks) {
+      coldBlock = isCold(*BB);
+      unsigned int size = BB->size();
+      unsigned int maxSize = coldBlock ? SLPColdBlockSize : SLPMaxBlockSize;
+      const char *reason = nullptr;
+      if (size > maxSize) {
+        reason = "BlockTooLarge";
+      } else if (SLPFunctionBudget > 0 &&
+                 analyzed + size > SLPFunctionBudget) {
+        reason = "BudgetExhausted";
+      }
+      if (reason) {
+        NumSkippedBlocks++;
+        logs() << "[analyze] " << reason << ": " << BB->getName() << " ("
+               << size << " instructions)\n";
+        remark([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, reason, &BB->front())
+                 << "not analyzed: the block has "
+                 << ore::NV("Instructions", size) << " instructions"
+                 << (size > maxSize ? ", more than the limit"
+                                    : ", more than the remaining budget of "
+                                      "the function");
+        });
+        continue;
+      }
+      analyzed += size;
+      if (coldBlock) {
+        NumColdBlocks++;
+        coldBlocks.insert(BB);
+      }
+
+      // The cache is not looked up when remarks are requested, since a
+      // cached block would not explain its scalar statements again
+      auto P = std::make_unique<PackSet>();
+      std::string key;
+      if (!SLPPlanCacheDir.empty()) {
+        key = getPlanKey(*BB);
+        Optional<bool> cached;
+        if (!ORE->allowExtraAnalysis(DEBUG_TYPE)) {
+          cached = loadPlan(*BB, key, *P);
+        }
+        if (cached.hasValue()) {
+          NumPlanCacheHits++;
+          logs() << "[analyze] cached plan " << key << ": " << BB->getName()
+                 << (*cached ? "" : " (scalar)") << "\n";
+          if (*cached) {
+            plans.push_back(std::make_pair(BB, std::move(P)));
+          }
+          continue;
+        }
+        NumPlanCacheMisses++;
+        P = std::make_unique<PackSet>();
+      }
+
+      bool planned = slpExtract(*BB, *P);
+      if (!key.empty()) {
+        storePlan(*BB, key, planned ? P.get() : nullptr);
+      }
+      if (planned) {
+        plans.push_back(std::make_pair(BB, std::move(P)));
+      }
+    }
+    coldBlock = false;
   }
 
-  bool slpExtract(BasicBlock &BB) {
-    PackSet P;
-    findAdjRefs(BB, P);
-    extendPacklist(BB, P);
-    combinePacks(P);
-    P.printPackSet();
-    bool sched = P.schedule();
-    if (sched) {
-      P.printScheduledPackList();
-      P.findPrePack();
-      P.findPostPack();
-      codeGen(P);
-      return true;
+  /*
+   * Whether BB runs rarely: cold in the profile when there is one, otherwise
+   * estimated to run less than an eighth as often as the entry of F
+   */
+  bool isCold(BasicBlock &BB) {
+    if (PSI && PSI->hasProfileSummary()) {
+      return PSI->isColdBlock(&BB, BFI);
     }
-    return false;
+    return BFI->getBlockFreq(&BB).getFrequency() * 8 < BFI->getEntryFreq();
   }
 
-  void findAdjRefs(BasicBlock &BB, PackSet &P) {
-    // Find the base addresses of memory reference
-    setAlignRef(BB);
+  /*
+   * Key of the plan of BB in the plan cache: a hash of the structure of BB,
+   * and of everything else its plan depends on, i.e. the target, the options
+   * of the pass and whether BB is cold. Statements are numbered by their
+   * position in BB, and the values defined outside BB by their first use, so
+   * that renaming values or editing other blocks keeps the key.
+   */
+  std::string getPlanKey(BasicBlock &BB) {
+    std::string text;
+    raw_string_ostream OS(text);
+    OS << "slp-plan-1 " << F.getParent()->getTargetTriple() << " "
+       << F.getFnAttribute("target-cpu").getValueAsString() << " "
+       << F.getFnAttribute("target-features").getValueAsString() << " "
+       << SLPVectorBits << " " << SLPMaxStride << " " << SLPExactSelectLimit
+       << " " << SLPMaxPairs << " " << getVectorRegisters() << " "
+       << coldBlock << "\n";
 
-    // Find all adjacent memory references and add to PackSet
-    for (auto &s1 : BB) {
-      for (auto &s2 : BB) {
-        if ((&s2 != &s1) && s1.mayReadOrWriteMemory() &&
-            s2.mayReadOrWriteMemory()) {
-          if (adjacent(&s1, &s2)) {
-            auto align = getAlignment(&s1);
-            if (stmtsCanPack(BB, P, &s1, &s2, align)) {
-              P.addPair(&s1, &s2);
-            }
-          }
+    std::map<Value *, unsigned int> local, outside;
+    for (auto &s : BB) {
+      unsigned int index = local.size();
+      local[&s] = index;
+    }
+    for (auto &s : BB) {
+      OS << s.getOpcodeName() << " " << *s.getType();
+      for (auto &operand : s.operands()) {
+        Value *v = operand.get();
+        if (local.count(v)) {
+          OS << " %" << local[v];
+        } else if (auto arg = dyn_cast<Argument>(v)) {
+          OS << " a" << arg->getArgNo();
+        } else if (isa<Constant>(v)) {
+          OS << " ";
+          v->printAsOperand(OS, true, F.getParent());
+        } else {
+          unsigned int index = outside.size();
+          OS << " o" << outside.insert({v, index}).first->second << ":"
+             << *v->getType();
         }
       }
+
+      // Flags that change what the statements compute or access
+      if (auto FPOp = dyn_cast<FPMathOperator>(&s)) {
+        OS << " ";
+        FPOp->getFastMathFlags().print(OS);
+      }
+      if (auto OBO = dyn_cast<OverflowingBinaryOperator>(&s)) {
+        OS << " w" << OBO->hasNoUnsignedWrap() << OBO->hasNoSignedWrap();
+      }
+      if (auto PEO = dyn_cast<PossiblyExactOperator>(&s)) {
+        OS << " e" << PEO->isExact();
+      }
+      if (auto cmp = dyn_cast<CmpInst>(&s)) {
+        OS << " p" << cmp->getPredicate();
+      }
+      if (auto load = dyn_cast<LoadInst>(&s)) {
+        OS << " m" << load->getAlign().value() << load->isVolatile();
+      }
+      if (auto store = dyn_cast<StoreInst>(&s)) {
+        OS << " m" << store->getAlign().value() << store->isVolatile();
+      }
+      if (auto GEP = dyn_cast<GetElementPtrInst>(&s)) {
+        OS << " i" << GEP->isInBounds();
+      }
+      OS << "\n";
     }
+
+    MD5 hash;
+    hash.update(OS.str());
+    MD5::MD5Result result;
+    hash.final(result);
+    return result.digest().str().str();
   }
 
-  void setAlignRef(BasicBlock &BB) {
-    unsigned int divisor = UINT32_MAX;
+  std::string getPlanPath(const std::string &key) {
+    SmallString<128> path(SLPPlanCacheDir);
+    sys::path::append(path, key + ".plan");
+    return path.str().str();
+  }
+
+  /*
+   * Read the plan of BB cached under key into P. A plan is one line per pack
+   * in schedule order: whether the pack depends on another one, then the
+   * position in BB of each lane; a block left scalar has an empty plan.
+   *
+   * Returns None when there is no usable plan: the lanes of every pack must
+   * still be isomorphic, independent and, for memory packs, evenly spaced,
+   * since the addresses also depend on the code outside BB.
+   */
+  Optional<bool> loadPlan(BasicBlock &BB, const std::string &key,
+                          PackSet &P) {
+    auto buffer = MemoryBuffer::getFile(getPlanPath(key));
+    if (!buffer) {
+      return None;
+    }
+
+    std::vector<Instruction *> stmts;
     for (auto &s : BB) {
-      // Only look at memory access instructions
-      if (s.mayReadOrWriteMemory()) {
-        // getelementptr instruction
-        GetElementPtrInst *gep = nullptr;
+      stmts.push_back(&s);
+    }
+    setAlignRef(BB);
 
-        // Load instruction
-        if (auto loadInst = dyn_cast<LoadInst>(&s)) {
-          auto loadPtr = loadInst->getPointerOperand();
-          gep = dyn_cast<GetElementPtrInst>(loadPtr);
-        }
-        // Store instruction
-        if (auto storeInst = dyn_cast<StoreInst>(&s)) {
-          auto storePtr = storeInst->getPointerOperand();
-          gep = dyn_cast<GetElementPtrInst>(storePtr);
+    SmallVector<StringRef, 16> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false);
+    std::set<Instruction *> packed;
+    std::vector<bool> dependent;
+    for (auto line : lines) {
+      SmallVector<StringRef, 8> fields;
+      line.split(fields, ' ', -1, false);
+      std::vector<Instruction *> lanes;
+      for (unsigned int i = 0; i < fields.size(); i++) {
+        unsigned int index;
+        if (fields[i].getAsInteger(10, index) ||
+            (i > 0 && (index >= stmts.size() ||
+                       !packed.insert(stmts[index]).second))) {
+          P.clear();
+          return None;
         }
-
-        // Only look at load/store with simple gep
-        if (!gep || gep->getNumIndices() > 2) {
-          continue;
+        if (i == 0) {
+          dependent.push_back(index != 0);
+        } else {
+          lanes.push_back(stmts[index]);
         }
-        unsigned int gepNumIndices = gep->getNumIndices();
+      }
+      if (lanes.size() < 2) {
+        P.clear();
+        return None;
+      }
+      P.addChain(lanes);
+    }
+    if (P.size() == 0) {
+      return false;
+    }
 
-        // When GEP uses global address (e.g., @A in foo), check whether the
-        // first index is 0
-        if (gepNumIndices == 2) {
-          if (auto gepIndex0 = dyn_cast<ConstantInt>(gep->getOperand(1))) {
-            if (gepIndex0->getZExtValue() != 0) {
-              continue;
-            }
-          }
-        }
+    for (auto &pack : P) {
+      Instruction *first = pack.getFirstElement();
+      unsigned int stride = 1;
+      if (first->mayReadOrWriteMemory()) {
+        stride = getStride(&pack);
+      }
+      bool valid = stride > 0 && canGenerate(pack) &&
+                   (!isa<PHINode>(first) || isCarried(P, pack));
+      for (unsigned int i = 1; valid && i < pack.getSize(); i++) {
+        Instruction *s1 = pack.getNthElement(i - 1);
+        valid = cannotPack(s1, pack.getNthElement(i), getAlignment(s1),
+                           stride) == nullptr;
+      }
+      if (!valid) {
+        logs() << "[loadPlan] stale plan " << key << " for " << BB.getName()
+               << "\n";
+        P.clear();
+        return None;
+      }
+    }
+    P.restoreSchedule(dependent);
+    if (!canKeepScalarStores(P)) {
+      P.clear();
+      return None;
+    }
+    P.printScheduledPackList();
+    return true;
+  }
 
-        // Base address
-        Value *b = gep->getPointerOperand();
-        baseAddress.insert(b);
+  /*
+   * Write the plan P of BB to the cache under key, or an empty plan if BB
+   * stays scalar. The plan is written to a temporary file that is then
+   * renamed, so that concurrent builds never read a partial plan.
+   */
+  void storePlan(BasicBlock &BB, const std::string &key, PackSet *P) {
+    std::map<Instruction *, unsigned int> position;
+    for (auto &s : BB) {
+      unsigned int index = position.size();
+      position[&s] = index;
+    }
 
-        // Find the induction variable
-        Value *v = gep->getOperand(gepNumIndices);
-        unsigned int index = 0;
-        Value *operand0, *operand1;
-
-        while (auto addInst = dyn_cast<BinaryOperator>(v)) {
-          if (addInst->getOpcode() == Instruction::Add ||
-              addInst->getOpcode() == Instruction::Or) {
-            operand0 = addInst->getOperand(0);
-            operand1 = addInst->getOperand(1);
-            if (isa<ConstantInt>(operand1)) {
-              index += cast<ConstantInt>(operand1)->getZExtValue();
-            }
-            v = operand0;
-          } else {
-            break;
-          }
-        }
-        setAlignment(&s, b, v, index);
-        // Find the minimum positive divisor for all alignment info
-        if (index > 0 && index < divisor) {
-          divisor = index;
+    std::string plan;
+    raw_string_ostream OS(plan);
+    if (P) {
+      for (auto iter = P->lbegin(); iter != P->lend(); iter++) {
+        OS << P->hasDependency(*iter);
+        for (auto s : **iter) {
+          OS << " " << position[s];
         }
+        OS << "\n";
       }
     }
 
-    if (divisor == UINT32_MAX) {
+    std::lock_guard<std::mutex> lock(planCacheLock);
+    std::string path = getPlanPath(key);
+    int FD;
+    SmallString<128> tmpPath;
+    if (sys::fs::create_directories(SLPPlanCacheDir) ||
+        sys::fs::createUniqueFile(path + ".%%%%%%", FD, tmpPath)) {
+      logs() << "[storePlan] cannot write " << path << "\n";
       return;
     }
+    {
+      raw_fd_ostream file(FD, /*shouldClose=*/true);
+      file << OS.str();
+    }
+    if (sys::fs::rename(tmpPath, path)) {
+      sys::fs::remove(tmpPath);
+    }
+  }
+
+  /*
+   * Commit phase: generate vector code for the plans found by analyze().
+   * This modifies the IR (and may create constants and types shared across
+   * the module), so it must not run concurrently with any other function.
+   */
+  bool commit() {
+    outs() << log.str();
 
-    for (auto alignInfoEntry : alignInfo) {
-      auto instr = alignInfoEntry.first;
-      auto align = getAlignment(instr);
+    bool changed = false;
+    for (auto &plan : plans) {
+      std::unique_ptr<PackSet> P = std::move(plan.second);
+      Instruction *first = P->getNthPack(0).getFirstElement();
 
-      // Need to further check the correctness
-      // setAlignmentIndex(instr, align->index / divisor);
+      BasicBlock *BB = versionBlock(plan.first, *P);
+      if (BB == nullptr) {
+        logs() << "[commit] cannot check the aliasing of "
+               << plan.first->getName() << ", leaving it scalar\n";
+        remark([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "AliasCheckUnavailable",
+                                          first)
+                 << "not vectorized: the address ranges of the block cannot "
+                    "be checked for overlap before it";
+        });
+        continue;
+      }
+      changed = true;
+      size_t lanes = 0;
+      for (auto &pack : *P) {
+        lanes = std::max(lanes, pack.getSize());
+      }
+      remark([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Vectorized", first)
+               << "vectorized " << ore::NV("Packs", (unsigned)P->size())
+               << " packs of up to " << ore::NV("Lanes", lanes) << " lanes"
+               << (BB != plan.first ? " behind runtime alias checks" : "");
+      });
 
-      if (verbose)
-        outs() << "[setAlignRef] set alignment for (" << *instr
-               << "), base = " << align->base->getName()
-               << ", iv = " << align->inductionVar->getName()
-               << ", index = " << align->index << "\n";
+      // Cold blocks get a single round
+      coldBlock = coldBlocks.count(plan.first) > 0;
+      for (unsigned int round = 1;; round++) {
+        reorderOperands(*P);
+        codeGen(*P);
+        fuseMultiplyAdds(*BB);
+        forwardStores(*BB);
+        removeDeadCode(*BB);
+        forgetErased();
+
+        // Iterative mode: look for packs again in the rewritten block. Only
+        // the statements that are still scalar can be packed, see cannotPack
+        if (round >= SLPMaxRounds || coldBlock) {
+          break;
+        }
+        forgetPropagatedAlignment(*BB);
+        P = std::make_unique<PackSet>();
+        if (!slpExtract(*BB, *P)) {
+          break;
+        }
+        logs() << "[commit] round " << round + 1 << " for " << BB->getName()
+               << "\n";
+      }
     }
-  }
 
-  bool adjacent(Instruction *s1, Instruction *s2) {
-    return checkAlignment(getAlignment(s1), getAlignment(s2), 1);
+    plans.clear();
+    coldBlocks.clear();
+    coldBlock = false;
+    emitRemarks();
+
+    if (changed)
+      outs() << F.getName() << " SLP completed\n";
+    outs() << "\n";
+    return changed;
   }
 
-  void setAlignment(Instruction *s, Value *b, Value *iv, unsigned int index) {
-    alignInfo.emplace(std::map<Instruction *, AlignInfo>::value_type(
-        s, AlignInfo(b, iv, index)));
+  Function &getFunction() {
+    return F;
   }
 
-  void setAlignment(Instruction *dst, Instruction *src) {
-    AlignInfo *align = getAlignment(src);
-    alignInfo.emplace(
-        std::map<Instruction *, AlignInfo>::value_type(dst, *align));
+  /*
+   * Remarks are built lazily, like OptimizationRemarkEmitter::emit, and kept
+   * in the context until commit(): the analysis phase may run on another
+   * thread, while remarks must reach the LLVMContext one at a time
+   */
+  template <typename RemarkBuilder> void remark(RemarkBuilder build) {
+    if (ORE->allowExtraAnalysis(DEBUG_TYPE)) {
+      auto R = build();
+      remarks.push_back(std::make_unique<decltype(R)>(std::move(R)));
+    }
   }
 
-  void setAlignmentIndex(Instruction *s, unsigned int newIndex) {
-    auto align = getAlignment(s);
-    if (align) {
-      align->index = newIndex;
+  void emitRemarks() {
+    for (auto &R : remarks) {
+      ORE->emit(*R);
     }
+    remarks.clear();
   }
 
-  AlignInfo *getAlignment(Instruction *s) {
-    if (alignInfo.find(s) == alignInfo.end()) {
-      return nullptr;
+  // Analyses still valid after commit() changed the function
+  PreservedAnalyses getPreservedAnalyses() const {
+    PreservedAnalyses PA;
+    if (versioned) {
+      PA.preserve<DominatorTreeAnalysis>();
+      PA.preserve<LoopAnalysis>();
+    } else {
+      PA.preserveSet<CFGAnalyses>();
     }
-    return &(alignInfo.find(s)->second);
+    return PA;
   }
 
   /*
-   * Check alignment information
+   * Packing reorders the memory accesses of BB, which is only safe if the
+   * accesses through different base pointers, or through one base at offsets
+   * that differ by an unknown amount like A[i] and A[j], do not overlap. When
+   * alias analysis cannot prove that two bases are disjoint and one of them
+   * is written, compare at runtime the ranges of addresses BB accesses
+   * through them, and only run the vectorized block if none of them overlap:
+   *
+   *         BB (phis, checks)
+   *          /           \
+   *   BB.vector        BB.scalar (original copy)
+   *          \           /
+   *         BB.join (merge phis, terminator)
    *
-   * Check whether s1 and s2 shares the same base address, same induction
-   * variable, and the index differs by offset
+   * Return the block to vectorize, which is BB itself when no check is
+   * needed, or nullptr when the ranges cannot be computed before BB or P
+   * packs its phis, which stay in BB, away from the vector code
    */
-  bool checkAlignment(AlignInfo *s1, AlignInfo *s2, unsigned int offset) {
-    if (s1 == nullptr || s2 == nullptr) {
-      return false;
+  BasicBlock *versionBlock(BasicBlock *BB, PackSet &P) {
+    // Every range is a signed byte offset from its base, covering
+    // [min(lo), max(hi)). The accesses of one range are at constant distances
+    // from offset, which the packs account for
+    struct Range {
+      Value *base;
+      const SCEV *offset;
+      SmallVector<const SCEV *, 4> lo;
+      SmallVector<const SCEV *, 4> hi;
+      bool written = false;
+    };
+    std::vector<Range> ranges;
+    std::vector<Instruction *> unknown;
+    for (auto &s : *BB) {
+      AlignInfo *align = getAlignment(&s);
+      if (!s.mayReadOrWriteMemory()) {
+        continue;
+      }
+      if (align == nullptr) {
+        unknown.push_back(&s);
+        continue;
+      }
+      Type *type = align->offset->getType();
+      const SCEV *lo =
+          SE->getAddExpr(align->offset, SE->getConstant(type, align->index));
+      auto iter = std::find_if(ranges.begin(), ranges.end(), [&](Range &r) {
+        return r.base == align->base &&
+               isa<SCEVConstant>(SE->getMinusSCEV(align->offset, r.offset));
+      });
+      if (iter == ranges.end()) {
+        iter = ranges.insert(ranges.end(), Range{align->base, align->offset});
+      }
+      Range &range = *iter;
+      range.lo.push_back(lo);
+      range.hi.push_back(
+          SE->getAddExpr(lo, SE->getConstant(type, align->size)));
+      range.written |= s.mayWriteToMemory();
     }
-    if (s1->base != s2->base) {
-      return false;
+
+    // Accesses without a range, e.g. calls, cannot be checked: they must not
+    // touch the memory of any base, or only read memory that is only read
+    for (auto s : unknown) {
+      for (auto &range : ranges) {
+        ModRefInfo info = AA->getModRefInfo(
+            s, MemoryLocation::getBeforeOrAfter(range.base));
+        if (range.written ? isModOrRefSet(info) : isModSet(info)) {
+          if (verbose)
+            logs() << "[versionBlock] (" << *s << ") may access "
+                   << range.base->getName() << "\n";
+          return nullptr;
+        }
+      }
     }
-    if (s1->inductionVar != s2->inductionVar) {
-      return false;
+
+    std::vector<std::pair<size_t, size_t>> checks;
+    for (size_t r1 = 0; r1 < ranges.size(); r1++) {
+      for (size_t r2 = r1 + 1; r2 < ranges.size(); r2++) {
+        if (!ranges[r1].written && !ranges[r2].written) {
+          continue;
+        }
+        if (ranges[r1].base != ranges[r2].base &&
+            AA->isNoAlias(MemoryLocation::getBeforeOrAfter(ranges[r1].base),
+                          MemoryLocation::getBeforeOrAfter(ranges[r2].base))) {
+          continue;
+        }
+        checks.push_back(std::make_pair(r1, r2));
+      }
+    }
+    if (checks.empty()) {
+      return BB;
     }
-    return (s1->index + offset == s2->index);
-  }
 
-  bool stmtsCanPack(BasicBlock &BB, PackSet &P, Instruction *s1,
-                    Instruction *s2, AlignInfo *align) {
-    if (isIsomorphic(s1, s2) && isIndependent(s1, s2) && (s1 != s2)) {
-      if (!packedInLeft(P, s1) && !packedInRight(P, s2)) {
-        auto align_s1 = getAlignment(s1);
-        auto align_s2 = getAlignment(s2);
-        if (align_s1 == nullptr || checkAlignment(align, align_s1, 0)) {
-          if (align_s2 == nullptr || checkAlignment(align, align_s2, 1)) {
-            return true;
+    // The ranges are computed before BB, from values defined outside of it
+    auto definedInBB = [BB](const SCEV *S) {
+      auto unknown = dyn_cast<SCEVUnknown>(S);
+      auto s = unknown ? dyn_cast<Instruction>(unknown->getValue()) : nullptr;
+      return s && s->getParent() == BB && !isa<PHINode>(s);
+    };
+    for (auto &check : checks) {
+      for (size_t index : {check.first, check.second}) {
+        Value *base = ranges[index].base;
+        if (!isa<Instruction>(base) ||
+            cast<Instruction>(base)->getParent() != BB ||
+            isa<PHINode>(base)) {
+          continue;
+        }
+        return nullptr;
+      }
+    }
+    for (auto &range : ranges) {
+      for (auto offsets : {&range.lo, &range.hi}) {
+        for (auto offset : *offsets) {
+          if (SCEVExprContains(offset, definedInBB) ||
+              !isSafeToExpand(offset, *SE)) {
+            return nullptr;
           }
         }
       }
     }
-    return false;
-  }
+    if (checks.size() > SLPMaxAliasChecks || BB->isEHPad()) {
+      return nullptr;
+    }
+    for (auto &pack : P) {
+      if (isa<PHINode>(pack.getFirstElement())) {
+        return nullptr;
+      }
+    }
 
-  bool packedInLeft(PackSet &P, Instruction *s) {
-    for (auto &p : P) {
-      if (p.getLeftElement() == s) {
-        return true;
+    BasicBlock *body = SplitBlock(BB, &*BB->getFirstInsertionPt(), DT, LI);
+    BasicBlock *join = SplitBlock(body, body->getTerminator(), DT, LI);
+    body->setName(BB->getName() + ".vector");
+    join->setName(BB->getName() + ".join");
+
+    ValueToValueMapTy VMap;
+    BasicBlock *scalar = CloneBasicBlock(body, VMap, ".scalar", &F);
+    scalar->setName(BB->getName() + ".scalar");
+    SmallVector<BasicBlock *, 1> clones = {scalar};
+    remapInstructionsInBlocks(clones, VMap);
+    scalar->moveAfter(body);
+
+    // Values of the block used after it come from either copy
+    for (auto &s : *body) {
+      std::vector<Use *> outsideUses;
+      for (auto &use : s.uses()) {
+        if (cast<Instruction>(use.getUser())->getParent() != body) {
+          outsideUses.push_back(&use);
+        }
+      }
+      if (outsideUses.empty()) {
+        continue;
+      }
+      PHINode *merge = PHINode::Create(s.getType(), 2, s.getName() + ".merge",
+                                       &join->front());
+      merge->addIncoming(&s, body);
+      merge->addIncoming(VMap[&s], scalar);
+      for (auto use : outsideUses) {
+        use->set(merge);
       }
     }
-    return false;
-  }
 
-  bool packedInRight(PackSet &P, Instruction *s) {
-    for (auto &p : P) {
-      if (p.getRightElement() == s) {
-        return true;
+    // Two ranges overlap if each starts before the other ends
+    Instruction *oldBranch = BB->getTerminator();
+    IRBuilder<> builder(oldBranch);
+    SCEVExpander expander(*SE, DL, "slp.check");
+    std::map<size_t, std::pair<Value *, Value *>> bounds;
+    auto expand = [&](size_t index) {
+      auto iter = bounds.find(index);
+      if (iter != bounds.end()) {
+        return iter->second;
       }
+      Range &range = ranges[index];
+      unsigned int addressSpace =
+          range.base->getType()->getPointerAddressSpace();
+      Value *bytes =
+          builder.CreateBitCast(range.base, builder.getInt8PtrTy(addressSpace));
+      const SCEV *lo = SE->getSMinExpr(range.lo);
+      const SCEV *hi = SE->getSMaxExpr(range.hi);
+      Value *loOffset = expander.expandCodeFor(lo, lo->getType(), oldBranch);
+      Value *hiOffset = expander.expandCodeFor(hi, hi->getType(), oldBranch);
+      auto bound = std::make_pair(
+          builder.CreateGEP(builder.getInt8Ty(), bytes, loOffset),
+          builder.CreateGEP(builder.getInt8Ty(), bytes, hiOffset));
+      bounds[index] = bound;
+      return bound;
+    };
+    Value *overlap = nullptr;
+    for (auto &check : checks) {
+      auto r1 = expand(check.first);
+      auto r2 = expand(check.second);
+      Value *conflict =
+          builder.CreateAnd(builder.CreateICmpULT(r1.first, r2.second),
+                            builder.CreateICmpULT(r2.first, r1.second));
+      overlap = overlap ? builder.CreateOr(overlap, conflict) : conflict;
     }
-    return false;
+    builder.CreateCondBr(overlap, scalar, body);
+    oldBranch->eraseFromParent();
+
+    DT->addNewBlock(scalar, BB);
+    DT->changeImmediateDominator(join, BB);
+    if (Loop *L = LI->getLoopFor(BB)) {
+      L->addBasicBlockToLoop(scalar, *LI);
+      SE->forgetLoop(L);
+    }
+    versioned = true;
+
+    if (verbose)
+      logs() << "[versionBlock] " << checks.size()
+             << " runtime alias check(s) for " << BB->getName() << "\n";
+    return body;
   }
 
-  void extendPacklist(BasicBlock &BB, PackSet &P) {
-    bool changed;
-    // Apply BFS to search the def-use chain and extend pack list
-    unsigned int head = 0, tail;
-    do {
-      tail = P.size();
-      while (head < tail) {
-        followUseDefs(BB, P, P.getNthPack(head));
-        followDefUses(BB, P, P.getNthPack(head));
-        head++;
-      }
-    } while (head < P.size());
+  // Buffer the output of the analysis phase when running on another thread
+  void bufferLog() {
+    setLogStream(&log);
   }
 
-  int estSavings(Instruction *t1, Instruction *t2, PackSet &P) {
-    if (P.pairExists(t1, t2))
-      return -1;
-    else
-      return 1;
+  /*
+   * Code generation leaves the scalar address computations (getelementptr,
+   * index arithmetic) and casts of the packed statements behind. Remove them
+   * here, so that no separate -dce run is needed after the pass.
+   */
+  void removeDeadCode(BasicBlock &BB) {
+    // Users come after their definitions, so visiting the block backwards
+    // removes whole dead chains in one pass
+    for (auto iter = BB.rbegin(); iter != BB.rend();) {
+      Instruction *s = &*iter;
+      iter++;
+      if (isInstructionTriviallyDead(s, TLI)) {
+        erase(s);
+      }
+    }
   }
 
-  bool followUseDefs(BasicBlock &BB, PackSet &P, Pack p) {
-    bool changed = false;
+  /*
+   * The llvm.smin, smax, umin, umax, minnum, maxnum or abs call computing the
+   * same value as select, or nullptr. A floating-point select only becomes
+   * minnum or maxnum when its flags ignore NaNs and the sign of zero, where
+   * the two differ.
+   */
+  Value *matchMinMaxAbs(SelectInst *select) {
+    Value *lhs, *rhs;
+    Instruction::CastOps castOp = (Instruction::CastOps)0;
+    SelectPatternResult pattern = matchSelectPattern(select, lhs, rhs, &castOp);
+    if (castOp || select->getType()->isVectorTy()) {
+      return nullptr;
+    }
+
+    Intrinsic::ID id;
+    switch (pattern.Flavor) {
+    case SPF_SMIN:
+      id = Intrinsic::smin;
+      break;
+    case SPF_SMAX:
+      id = Intrinsic::smax;
+      break;
+    case SPF_UMIN:
+      id = Intrinsic::umin;
+      break;
+    case SPF_UMAX:
+      id = Intrinsic::umax;
+      break;
+    case SPF_FMINNUM:
+    case SPF_FMAXNUM:
+      if (pattern.NaNBehavior != SPNB_RETURNS_ANY ||
+          !select->hasNoSignedZeros()) {
+        return nullptr;
+      }
+      id = pattern.Flavor == SPF_FMINNUM ? Intrinsic::minnum
+                                         : Intrinsic::maxnum;
+      break;
+    case SPF_ABS: {
+      IRBuilder<> builder(select);
+      return builder.CreateBinaryIntrinsic(Intrinsic::abs, lhs,
+                                           builder.getFalse());
+    }
+    default:
+      return nullptr;
+    }
+
+    IRBuilder<> builder(select);
+    return builder.CreateBinaryIntrinsic(
+        id, lhs, rhs, isa<FPMathOperator>(select) ? select : nullptr);
+  }
+
+  // The llvm.minnum, maxnum or fabs call computing the same value as call
+  Value *matchLibCall(CallInst *call) {
+    Function *callee = call->getCalledFunction();
+    LibFunc func;
+    if (!callee || call->isNoBuiltin() || !TLI->getLibFunc(*callee, func) ||
+        !TLI->has(func)) {
+      return nullptr;
+    }
+
+    IRBuilder<> builder(call);
+    switch (func) {
+    case LibFunc_fminf:
+    case LibFunc_fmin:
+    case LibFunc_fminl:
+      return builder.CreateBinaryIntrinsic(Intrinsic::minnum,
+                                           call->getArgOperand(0),
+                                           call->getArgOperand(1), call);
+    case LibFunc_fmaxf:
+    case LibFunc_fmax:
+    case LibFunc_fmaxl:
+      return builder.CreateBinaryIntrinsic(Intrinsic::maxnum,
+                                           call->getArgOperand(0),
+                                           call->getArgOperand(1), call);
+    case LibFunc_fabsf:
+    case LibFunc_fabs:
+    case LibFunc_fabsl:
+      return builder.CreateUnaryIntrinsic(Intrinsic::fabs,
+                                          call->getArgOperand(0), call);
+    default:
+      return nullptr;
+    }
+  }
+
+  // The add or sub that the multiply s may be fused into, or nullptr
+  Instruction *fusedUser(Instruction *s) {
+    if (s->getOpcode() != Instruction::FMul || !s->hasAllowContract() ||
+        !s->hasOneUse()) {
+      return nullptr;
+    }
+    auto user = cast<Instruction>(*s->user_begin());
+    if ((user->getOpcode() != Instruction::FAdd &&
+         user->getOpcode() != Instruction::FSub) ||
+        !user->hasAllowContract() || user->getParent() != s->getParent()) {
+      return nullptr;
+    }
+    return user;
+  }
+
+  /*
+   * Fuse every vector multiply of BB whose only user is a vector add or sub
+   * into llvm.fmuladd, when the fast-math flags of both allow contraction.
+   * The target emits one fused multiply-add for it where it has one, and the
+   * two separate operations otherwise.
+   */
+  void fuseMultiplyAdds(BasicBlock &BB) {
+    for (auto iter = BB.begin(); iter != BB.end();) {
+      Instruction *add = &*iter++;
+      if (!add->getType()->isVectorTy() ||
+          (add->getOpcode() != Instruction::FAdd &&
+           add->getOpcode() != Instruction::FSub)) {
+        continue;
+      }
+      for (unsigned int j = 0; j < 2; j++) {
+        auto mul = dyn_cast<Instruction>(add->getOperand(j));
+        if (!mul || fusedUser(mul) != add) {
+          continue;
+        }
+        IRBuilder<> builder(add);
+        FastMathFlags FMF = add->getFastMathFlags();
+        FMF &= mul->getFastMathFlags();
+        builder.setFastMathFlags(FMF);
+
+        // a * b - c = fmuladd(a, b, -c) and c - a * b = fmuladd(-a, b, c)
+        Value *x = mul->getOperand(0), *y = mul->getOperand(1);
+        Value *addend = add->getOperand(1 - j);
+        if (add->getOpcode() == Instruction::FSub) {
+          if (j == 0) {
+            addend = builder.CreateFNeg(addend);
+          } else {
+            x = builder.CreateFNeg(x);
+          }
+        }
+        Value *fused = builder.CreateIntrinsic(
+            Intrinsic::fmuladd, {add->getType()}, {x, y, addend});
+        if (verbose)
+          logs() << "[fuseMultiplyAdds] " << *fused << "\n";
+        fused->takeName(add);
+        add->replaceAllUsesWith(fused);
+        erase(add);
+        erase(mul);
+        break;
+      }
+    }
+  }
+
+  /*
+   * Store-to-load forwarding: a load that only reads bytes written by an
+   * earlier vector store of BB, with no possible write to them in between,
+   * takes its value from the stored vector with an extractelement or a
+   * shufflevector. Reloading it right after the store would stall on most
+   * cores, since the store buffer cannot forward part of a vector store.
+   */
+  void forwardStores(BasicBlock &BB) {
+    for (auto iter = BB.begin(); iter != BB.end();) {
+      auto load = dyn_cast<LoadInst>(&*iter++);
+      if (!load || !load->isSimple()) {
+        continue;
+      }
+
+      // Latest write that may reach the load
+      MemoryLocation loc = MemoryLocation::get(load);
+      for (auto prev = load->getReverseIterator(); ++prev != BB.rend();) {
+        if (!isModSet(AA->getModRefInfo(&*prev, loc))) {
+          continue;
+        }
+        auto store = dyn_cast<StoreInst>(&*prev);
+        Value *value = store ? forwardedValue(store, load) : nullptr;
+        if (value) {
+          if (verbose)
+            logs() << "[forwardStores] (" << *load << ") from (" << *store
+                   << ")\n";
+          load->replaceAllUsesWith(value);
+          erase(load);
+        }
+        break;
+      }
+    }
+  }
+
+  // The value load reads from the bytes written by store, or nullptr
+  Value *forwardedValue(StoreInst *store, LoadInst *load) {
+    auto vecType =
+        dyn_cast<FixedVectorType>(store->getValueOperand()->getType());
+    if (!vecType || !store->isSimple()) {
+      return nullptr;
+    }
+    Type *elemType = vecType->getElementType();
+    unsigned int lanes = 1;
+    if (auto loadVecType = dyn_cast<FixedVectorType>(load->getType())) {
+      lanes = loadVecType->getNumElements();
+      if (loadVecType->getElementType() != elemType) {
+        return nullptr;
+      }
+    } else if (load->getType() != elemType) {
+      return nullptr;
+    }
+
+    auto distance = dyn_cast<SCEVConstant>(
+        SE->getMinusSCEV(SE->getSCEV(load->getPointerOperand()),
+                         SE->getSCEV(store->getPointerOperand())));
+    int64_t elemSize = DL.getTypeStoreSize(elemType);
+    if (!distance ||
+        DL.getTypeSizeInBits(elemType) != DL.getTypeStoreSizeInBits(elemType)) {
+      return nullptr;
+    }
+    int64_t bytes = distance->getAPInt().getSExtValue();
+    if (bytes < 0 || bytes % elemSize != 0 ||
+        bytes / elemSize + lanes > vecType->getNumElements()) {
+      return nullptr;
+    }
+
+    IRBuilder<> builder(load);
+    Value *stored = store->getValueOperand();
+    unsigned int first = bytes / elemSize;
+    if (!load->getType()->isVectorTy()) {
+      return builder.CreateExtractElement(stored, first);
+    }
+    if (lanes == vecType->getNumElements()) {
+      return stored;
+    }
+    return builder.CreateShuffleVector(stored, UndefValue::get(vecType),
+                                       createSequentialMask(first, lanes, 0));
+  }
+
+  // Erase s from the IR, and remember to drop it from the cached analyses
+  void erase(Instruction *s) {
+    erased.insert(s);
+    s->eraseFromParent();
+  }
+
+  /*
+   * Drop the cached alignment and dependence information of the erased
+   * instructions, whose addresses may be reused by new instructions
+   */
+  void forgetErased() {
+    for (auto s : erased) {
+      alignInfo.erase(s);
+    }
+    for (auto iter = independence.begin(); iter != independence.end();) {
+      if (erased.count(iter->first.first) || erased.count(iter->first.second)) {
+        iter = independence.erase(iter);
+      } else {
+        iter++;
+      }
+    }
+    erased.clear();
+  }
+
+  /*
+   * Alignment information of memory accesses comes from their addresses and
+   * stays valid across rounds, but the information propagated to other
+   * statements depends on the packs found in the previous round
+   */
+  void forgetPropagatedAlignment(BasicBlock &BB) {
+    for (auto &s : BB) {
+      if (!s.mayReadOrWriteMemory()) {
+        alignInfo.erase(&s);
+      }
+    }
+  }
+
+  // Cached version of isIndependent
+  bool independent(Instruction *s1, Instruction *s2) {
+    auto key = std::make_pair(s1, s2);
+    auto iter = independence.find(key);
+    if (iter != independence.end()) {
+      return iter->second;
+    }
+    bool result = isIndependent(s1, s2);
+    independence[key] = result;
+    return result;
+  }
+
+  bool slpExtract(BasicBlock &BB, PackSet &P) {
+    // Candidate pairs, which may conflict with each other
+    PackSet C;
+    rejectedPairs.clear();
+    findAdjRefs(BB, C);
+    findReductionLeaves(BB, C);
+    extendPacklist(BB, C);
+
+    selectPacks(C, P);
+    combinePacks(P);
+    cutUnsupported(P);
+    P.printPackSet();
+
+    // Explain the rejected pairs whose statements stay scalar
+    for (auto &rejected : rejectedPairs) {
+      Instruction *s1 = std::get<0>(rejected);
+      Instruction *s2 = std::get<1>(rejected);
+      if (P.findPack(s1) == nullptr && P.findPack(s2) == nullptr) {
+        remarkCannotPack(s1, s2, std::get<2>(rejected));
+      }
+    }
+
+    // Spilled vectors would cost more than the packs save, so the packs
+    // that save the least are dropped until the vectors fit
+    if (P.size() > 0) {
+      unsigned int pressure = estimatePressure(BB, P);
+      NumPeakLiveVectors.updateMax(pressure);
+      if (pressure > getVectorRegisters()) {
+        Instruction *first = P.getNthPack(0).getFirstElement();
+        pressure = trimPacks(BB, P, pressure);
+        if (P.size() == 0) {
+          NumHighPressureBlocks++;
+          logs() << "[slpExtract] " << pressure << " live vectors in "
+                 << BB.getName() << ", leaving it scalar\n";
+          remark([&]() {
+            return OptimizationRemarkMissed(DEBUG_TYPE, "RegisterPressure",
+                                            first)
+                   << "not vectorized: no packs fit in the "
+                   << ore::NV("Registers", getVectorRegisters())
+                   << " vector registers";
+          });
+          return false;
+        }
+      }
+    }
+
+    // Cut packs and operand vectors built from scalars may cost more than
+    // the remaining packs save
+    int savings = estimateBlockSavings(P);
+    if (P.size() > 0 && savings <= 0) {
+      logs() << "[slpExtract] savings = " << savings << " for "
+             << BB.getName() << ", leaving it scalar\n";
+      remark([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "NotProfitable",
+                                        P.getNthPack(0).getFirstElement())
+               << "not vectorized: the " << ore::NV("Packs", (unsigned)P.size())
+               << " packs would save " << ore::NV("Savings", savings)
+               << " statements";
+      });
+      return false;
+    }
+
+    // A fill needs no other pack, its lanes are stored as one vector, and
+    // neither does a reduction, its lanes are reduced as one vector
+    Pack *first = P.size() == 1 ? &P.getNthPack(0) : nullptr;
+    std::vector<Instruction *> nodes;
+    bool sched = P.schedule(
+        first && (isa<StoreInst>(first->getFirstElement())
+                      ? isFill(P, first)
+                      : findReduction(P, *first, nodes) != nullptr));
+    if (sched) {
+      P.printScheduledPackList();
+
+      if (!canSinkScalarUsers(BB, P) || !canKeepScalarStores(P)) {
+        return false;
+      }
+
+      P.findPrePack();
+      P.findPostPack();
+      return true;
+    }
+    if (P.size() > 0) {
+      remark([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "NotScheduled",
+                                        P.getNthPack(0).getFirstElement())
+               << "not vectorized: the " << ore::NV("Packs", (unsigned)P.size())
+               << " selected packs cannot be scheduled: "
+               << ore::NV("Reason", P.getScheduleFailure());
+      });
+    }
+    return false;
+  }
+
+  void findAdjRefs(BasicBlock &BB, PackSet &P) {
+    // Find the base addresses of memory reference
+    setAlignRef(BB);
+
+    // Find all adjacent memory references and add to PackSet
+    std::set<Instruction *> hasNeighbor;
+    for (auto &s1 : BB) {
+      for (auto &s2 : BB) {
+        if ((&s2 != &s1) && s1.mayReadOrWriteMemory() &&
+            s2.mayReadOrWriteMemory()) {
+          if (adjacent(&s1, &s2) && s1.getOpcode() == s2.getOpcode() &&
+              !canExtend(&s1, &s2) && hasStridedNeighbor(BB, &s1)) {
+            rejectedPairs.push_back(std::make_tuple(
+                &s1, &s2,
+                isa<StoreInst>(&s1) ? "ValuesNotIsomorphic"
+                                    : "UsersNotIsomorphic"));
+          } else if (adjacent(&s1, &s2)) {
+            hasNeighbor.insert(&s1);
+            auto align = getAlignment(&s1);
+            const char *reason = cannotPack(&s1, &s2, align, 1);
+            if (reason == nullptr) {
+              P.addPair(&s1, &s2);
+            } else {
+              rejectedPairs.push_back(std::make_tuple(&s1, &s2, reason));
+            }
+          }
+        }
+      }
+    }
+
+    // Accesses without a contiguous neighbor may still be interleaved with
+    // others at a fixed stride, e.g. A[i], A[i + 2], A[i + 4], ...; cold
+    // blocks skip this search
+    unsigned int maxStride = coldBlock ? 1 : SLPMaxStride;
+    for (unsigned int stride = 2; stride <= maxStride; stride++) {
+      for (auto &s1 : BB) {
+        if (!s1.mayReadOrWriteMemory() ||
+            hasNeighbor.find(&s1) != hasNeighbor.end()) {
+          continue;
+        }
+        for (auto &s2 : BB) {
+          if ((&s2 != &s1) && s2.mayReadOrWriteMemory()) {
+            auto align = getAlignment(&s1);
+            if (checkAlignment(align, getAlignment(&s2), stride) &&
+                stmtsCanPack(BB, P, &s1, &s2, align, stride)) {
+              hasNeighbor.insert(&s1);
+              P.addPair(&s1, &s2);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /*
+   * Pair the leaves of reduction trees, e.g. the products in
+   * a * a + b * b + c * c + d * d, which no memory access leads to. Leaves
+   * next to each other in program order are paired; findReduction() then
+   * replaces the tree with one vector reduction.
+   */
+  void findReductionLeaves(BasicBlock &BB, PackSet &P) {
+    for (auto &root : BB) {
+      if (!isReducible(&root) ||
+          (root.hasOneUse() &&
+           isReductionNode(&root, *root.user_begin(), P))) {
+        continue;
+      }
+      std::vector<Instruction *> leaves;
+      std::vector<Instruction *> worklist = {&root};
+      while (!worklist.empty()) {
+        Instruction *node = worklist.back();
+        worklist.pop_back();
+        for (unsigned int j = 0; j < 2; j++) {
+          Value *operand = node->getOperand(j);
+          auto leaf = dyn_cast<Instruction>(operand);
+          if (!operand->hasOneUse() || leaf == nullptr) {
+            continue;
+          }
+          if (isReductionNode(&root, leaf, P)) {
+            worklist.push_back(leaf);
+          } else if (leaf->getParent() == &BB &&
+                     !leaf->mayReadOrWriteMemory()) {
+            leaves.push_back(leaf);
+          }
+        }
+      }
+      if (leaves.size() < 2) {
+        continue;
+      }
+      std::sort(leaves.begin(), leaves.end(),
+                [](Instruction *a, Instruction *b) {
+                  return a->comesBefore(b);
+                });
+      for (size_t i = 0; i + 1 < leaves.size(); i++) {
+        Instruction *s1 = leaves[i], *s2 = leaves[i + 1];
+        if (!P.pairExists(s1, s2) &&
+            cannotPack(s1, s2, getAlignment(s1), 1) == nullptr) {
+          P.addPair(s1, s2);
+        }
+      }
+    }
+  }
+
+  /*
+   * Whether s1 has a neighbor, before or after it, at a stride larger than
+   * one that it could grow a pack with, so that an adjacent access it cannot
+   * extend is left to the strided search instead
+   */
+  bool hasStridedNeighbor(BasicBlock &BB, Instruction *s1) {
+    unsigned int maxStride = coldBlock ? 1 : SLPMaxStride;
+    auto align = getAlignment(s1);
+    for (unsigned int stride = 2; stride <= maxStride; stride++) {
+      for (auto &s2 : BB) {
+        if (&s2 != s1 && s2.mayReadOrWriteMemory() &&
+            (checkAlignment(align, getAlignment(&s2), stride) ||
+             checkAlignment(getAlignment(&s2), align, stride)) &&
+            canExtend(s1, &s2)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /*
+   * Check whether a pair of adjacent accesses could grow into a larger pack:
+   * stores must store isomorphic values, and loads must have isomorphic
+   * users. Otherwise, e.g. for the real and imaginary parts of complex
+   * numbers, the accesses are better paired at a larger stride.
+   */
+  bool canExtend(Instruction *s1, Instruction *s2) {
+    if (s1->getOpcode() != s2->getOpcode()) {
+      return false;
+    }
+    if (auto store1 = dyn_cast<StoreInst>(s1)) {
+      auto v1 = dyn_cast<Instruction>(store1->getValueOperand());
+      auto v2 = dyn_cast<Instruction>(
+          cast<StoreInst>(s2)->getValueOperand());
+      return !v1 || !v2 || isIsomorphic(v1, v2);
+    }
+    if (s1->use_empty() || s2->use_empty()) {
+      return true;
+    }
+    for (auto u1 : s1->users()) {
+      for (auto u2 : s2->users()) {
+        if (isIsomorphic(cast<Instruction>(u1), cast<Instruction>(u2))) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /*
+   * Compute the alignment information of every load and store from the
+   * ScalarEvolution expression of its address: the pointer base, the
+   * non-constant part of the offset, and the constant byte offset. This
+   * handles any affine address, e.g. multi-dimensional arrays, scaled or
+   * sign/zero-extended indices and incremented pointers.
+   */
+  void setAlignRef(BasicBlock &BB) {
+    // SCEV creation may create constants in the shared LLVMContext
+    std::lock_guard<std::mutex> lock(contextLock);
+
+    for (auto &s : BB) {
+      // Only look at memory access instructions
+      if (s.mayReadOrWriteMemory()) {
+        // Already analyzed in an earlier round
+        if (getAlignment(&s)) {
+          continue;
+        }
+
+        Value *ptr = getLoadStorePointerOperand(&s);
+        if (!ptr || !SE->isSCEVable(ptr->getType())) {
+          continue;
+        }
+        Type *type = isa<LoadInst>(&s)
+                         ? s.getType()
+                         : cast<StoreInst>(&s)->getValueOperand()->getType();
+
+        // Base address
+        const SCEV *ptrSCEV = SE->getSCEV(ptr);
+        auto baseSCEV = dyn_cast<SCEVUnknown>(SE->getPointerBase(ptrSCEV));
+        if (!baseSCEV) {
+          continue;
+        }
+        Value *b = baseSCEV->getValue();
+        baseAddress.insert(b);
+
+        // Split the offset into its non-constant part and a constant
+        const SCEV *offset = SE->getMinusSCEV(ptrSCEV, baseSCEV);
+        if (isa<SCEVCouldNotCompute>(offset)) {
+          continue;
+        }
+        int64_t index = 0;
+        offset = splitConstantOffset(offset, index);
+
+        setAlignment(&s, b, offset, index, DL.getTypeStoreSize(type));
+
+        if (verbose)
+          logs() << "[setAlignRef] set alignment for (" << s
+                 << "), base = " << b->getName() << ", offset = " << *offset
+                 << ", index = " << index << "\n";
+      }
+    }
+  }
+
+  /*
+   * Move the constant term of offset into index and return the rest, e.g.
+   *   (24 + (8 * %i))   ->  (8 * %i), index += 24
+   *   {12,+,16}<%loop>  ->  {0,+,16}<%loop>, index += 12
+   */
+  const SCEV *splitConstantOffset(const SCEV *offset, int64_t &index) {
+    if (auto constant = dyn_cast<SCEVConstant>(offset)) {
+      index += constant->getAPInt().getSExtValue();
+      return SE->getZero(offset->getType());
+    }
+    if (auto add = dyn_cast<SCEVAddExpr>(offset)) {
+      // Constants are always the first operand of a SCEVAddExpr
+      if (auto constant = dyn_cast<SCEVConstant>(add->getOperand(0))) {
+        index += constant->getAPInt().getSExtValue();
+        return SE->getMinusSCEV(offset, constant);
+      }
+    }
+    if (auto addRec = dyn_cast<SCEVAddRecExpr>(offset)) {
+      if (addRec->isAffine()) {
+        const SCEV *start = splitConstantOffset(addRec->getStart(), index);
+        return SE->getAddRecExpr(start, addRec->getStepRecurrence(*SE),
+                                 addRec->getLoop(), SCEV::FlagAnyWrap);
+      }
+    }
+    return offset;
+  }
+
+  bool adjacent(Instruction *s1, Instruction *s2) {
+    return checkAlignment(getAlignment(s1), getAlignment(s2), 1);
+  }
+
+  // Distance in elements between s1 and s2, or 1 if it is not known
+  unsigned int getStride(Instruction *s1, Instruction *s2) {
+    auto align_s1 = getAlignment(s1);
+    auto align_s2 = getAlignment(s2);
+    if (align_s1 == nullptr || align_s2 == nullptr) {
+      return 1;
+    }
+    for (unsigned int stride = 2; stride <= SLPMaxStride; stride++) {
+      if (checkAlignment(align_s1, align_s2, stride)) {
+        return stride;
+      }
+    }
+    return 1;
+  }
+
+  /*
+   * Distance in elements between two consecutive lanes of the memory pack p,
+   * or 0 if the lanes are not evenly spaced
+   */
+  unsigned int getStride(Pack *p) {
+    unsigned int stride = getStride(p->getNthElement(0), p->getNthElement(1));
+    for (unsigned int i = 1; i < p->getSize(); i++) {
+      if (!checkAlignment(getAlignment(p->getNthElement(i - 1)),
+                          getAlignment(p->getNthElement(i)), stride)) {
+        return 0;
+      }
+    }
+    return stride;
+  }
+
+  void setAlignment(Instruction *s, Value *b, const SCEV *offset,
+                    int64_t index, uint64_t size) {
+    alignInfo.emplace(std::map<Instruction *, AlignInfo>::value_type(
+        s, AlignInfo(b, offset, index, size)));
+  }
+
+  void setAlignment(Instruction *dst, Instruction *src) {
+    AlignInfo *align = getAlignment(src);
+    alignInfo.emplace(
+        std::map<Instruction *, AlignInfo>::value_type(dst, *align));
+  }
+
+  AlignInfo *getAlignment(Instruction *s) {
+    if (alignInfo.find(s) == alignInfo.end()) {
+      return nullptr;
+    }
+    return &(alignInfo.find(s)->second);
+  }
+
+  /*
+   * Check alignment information
+   *
+   * Check whether s1 and s2 shares the same base address, same non-constant
+   * offset, and the constant offsets differ by lanes elements
+   */
+  bool checkAlignment(AlignInfo *s1, AlignInfo *s2, unsigned int lanes) {
+    if (s1 == nullptr || s2 == nullptr) {
+      return false;
+    }
+    if (s1->base != s2->base) {
+      return false;
+    }
+    if (s1->offset != s2->offset || s1->size != s2->size) {
+      return false;
+    }
+    return (s1->index + (int64_t)(lanes * s1->size) == s2->index);
+  }
+
+  /*
+   * Check whether s1 and s2 can be packed, where align is the alignment of the
+   * left element and stride the distance between two lanes in elements
+   */
+  bool stmtsCanPack(BasicBlock &BB, PackSet &P, Instruction *s1,
+                    Instruction *s2, AlignInfo *align, unsigned int stride) {
+    return cannotPack(s1, s2, align, stride) == nullptr;
+  }
+
+  // Reason code why s1 and s2 cannot be packed, or nullptr if they can
+  const char *cannotPack(Instruction *s1, Instruction *s2, AlignInfo *align,
+                         unsigned int stride) {
+    // Lanes are scalars: vectors built by an earlier round are not repacked
+    Type *type = isa<StoreInst>(s1)
+                     ? cast<StoreInst>(s1)->getValueOperand()->getType()
+                     : s1->getType();
+    if (!VectorType::isValidElementType(type)) {
+      return "NotScalar";
+    }
+    if (s1 == s2 || !isIsomorphic(s1, s2)) {
+      return "NotIsomorphic";
+    }
+    if (!independent(s1, s2)) {
+      return "Dependent";
+    }
+    auto align_s1 = getAlignment(s1);
+    auto align_s2 = getAlignment(s2);
+    if ((align_s1 != nullptr && !checkAlignment(align, align_s1, 0)) ||
+        (align_s2 != nullptr && !checkAlignment(align, align_s2, stride))) {
+      return "Misaligned";
+    }
+    return nullptr;
+  }
+
+  // Explain why the pair (s1, s2), which the packs lead to, was not packed
+  void remarkCannotPack(Instruction *s1, Instruction *s2, const char *reason) {
+    if (!remarkedPairs.insert(std::make_pair(s1, s2)).second) {
+      return;
+    }
+    remark([&]() {
+      return OptimizationRemarkMissed(DEBUG_TYPE, "CannotPack", s1)
+             << "cannot pack " << ore::NV("Stmt", s1) << " with "
+             << ore::NV("Other", s2) << ": " << ore::NV("Reason", reason);
+    });
+  }
+
+  void extendPacklist(BasicBlock &BB, PackSet &P) {
+    // Apply BFS to search the def-use chain and extend pack list
+    unsigned int head = 0, tail;
+    do {
+      tail = P.size();
+      while (head < tail) {
+        if (P.size() >= SLPMaxPairs) {
+          logs() << "[extendPacklist] stopped at " << P.size()
+                 << " candidate pairs in " << BB.getName() << "\n";
+          return;
+        }
+        followUseDefs(BB, P, P.getNthPack(head));
+        followDefUses(BB, P, P.getNthPack(head));
+        head++;
+      }
+    } while (head < P.size());
+  }
+
+  /*
+   * Estimate the savings of packing the candidate pair (t1, t2), given all
+   * the candidate pairs in C.
+   *
+   * Packing replaces two scalar statements with one vector statement. Every
+   * operand position that is not fed by another candidate pair, a splat or
+   * constants costs a pack, and every lane used outside the candidates costs
+   * an unpack.
+   */
+  int estSavings(Instruction *t1, Instruction *t2, PackSet &C) {
+    int savings = 1;
+
+    bool swap = shouldCommute(t1, t2);
+    std::set<std::pair<Value *, Value *>> built;
+    unsigned int m = t1->getNumOperands();
+    if (t1->mayReadOrWriteMemory() && getStride(t1, t2) > 1) {
+      // Strided lanes need a shuffle to (de)interleave
+      savings--;
+    }
+    if (isa<LoadInst>(t1)) {
+      // The address of a load pack is a single pointer
+      m = 0;
+    } else if (isa<StoreInst>(t1)) {
+      // The address of a store pack is a single pointer
+      m = 1;
+    } else if (auto call = dyn_cast<CallInst>(t1)) {
+      m = call->arg_size();
+    }
+    for (unsigned int j = 0; j < m; j++) {
+      Value *o1 = t1->getOperand(j);
+      Value *o2 = getPairedOperand(t1, t2, (swap && j < 2) ? 1 - j : j);
+      if (o1 == o2 || (isa<Constant>(o1) && isa<Constant>(o2))) {
+        continue;
+      }
+      // the same lanes as an earlier operand, e.g. a * a and b * b, reuse
+      // its vector
+      if (!built.insert(std::make_pair(o1, o2)).second) {
+        continue;
+      }
+      // the vector entering the loop is built once, before it
+      auto phi = dyn_cast<PHINode>(t1);
+      if (phi && phi->getIncomingBlock(j) != phi->getParent()) {
+        continue;
+      }
+      auto d1 = dyn_cast<Instruction>(o1);
+      auto d2 = dyn_cast<Instruction>(o2);
+      if (d1 && d2 && C.pairExists(d1, d2)) {
+        continue;
+      }
+      savings--;
+      // and the scalar code would have fused these multiplies into t1, t2
+      if (d1 && d2 && fusedUser(d1) == t1 && fusedUser(d2) == t2) {
+        savings--;
+      }
+    }
+
+    // Multiplies that are fused into a packed add or sub cost nothing, in
+    // scalar as well as in vector code
+    Instruction *f1 = fusedUser(t1), *f2 = fusedUser(t2);
+    if (f1 && f2 && C.pairExists(f1, f2)) {
+      savings--;
+    }
+
+    // Lanes summed (or multiplied, ...) by the same scalar tree are reduced
+    // in the vector, see findReduction()
+    Instruction *root = reductionRoot(t1, C);
+    if (root && reductionRoot(t2, C) == root) {
+      return savings;
+    }
+    for (auto t : {t1, t2}) {
+      for (auto *user : t->users()) {
+        if (C.findPack(cast<Instruction>(user)) == nullptr &&
+            !isExtractedAfter(cast<Instruction>(user), t->getParent())) {
+          savings--;
+          break;
+        }
+      }
+    }
+
+    return savings;
+  }
+
+  /*
+   * Check whether the pair (s1, s2) conflicts with the pairs already selected
+   * in P: every statement may be the left element of at most one pair and the
+   * right element of at most one pair, and the pairs must not chain into a
+   * cycle
+   */
+  bool canSelect(Instruction *s1, Instruction *s2,
+                 std::map<Instruction *, Instruction *> &next,
+                 std::set<Instruction *> &packedInRight) {
+    if (next.find(s1) != next.end() ||
+        packedInRight.find(s2) != packedInRight.end()) {
+      return false;
+    }
+    for (auto s = s2; next.find(s) != next.end(); s = next[s]) {
+      if (next[s] == s1) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*
+   * Choose a conflict-free subset of the candidate pairs in C that maximizes
+   * the total estimated savings, and add it to P.
+   *
+   * Blocks with few candidates are solved exactly by a branch and bound
+   * search; larger blocks greedily take the candidates with the highest
+   * savings first.
+   */
+  void selectPacks(PackSet &C, PackSet &P) {
+    std::vector<std::pair<int, Pack *>> candidates;
+    for (auto &c : C) {
+      int savings = estSavings(c.getLeftElement(), c.getRightElement(), C);
+      if (savings >= 0) {
+        candidates.push_back(std::make_pair(savings, &c));
+      }
+    }
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const std::pair<int, Pack *> &a,
+                        const std::pair<int, Pack *> &b) {
+                       return a.first > b.first;
+                     });
+
+    std::vector<bool> selected(candidates.size(), false);
+    std::map<Instruction *, Instruction *> next;
+    std::set<Instruction *> packedInRight;
+
+    if (!coldBlock && candidates.size() <= SLPExactSelectLimit) {
+      std::vector<bool> current(candidates.size(), false);
+      int best = -1;
+      searchPacks(candidates, 0, 0, current, selected, best, next,
+                  packedInRight);
+    } else {
+      for (unsigned int i = 0; i < candidates.size(); i++) {
+        auto s1 = candidates[i].second->getLeftElement();
+        auto s2 = candidates[i].second->getRightElement();
+        if (canSelect(s1, s2, next, packedInRight)) {
+          next[s1] = s2;
+          packedInRight.insert(s2);
+          selected[i] = true;
+        }
+      }
+    }
+
+    for (unsigned int i = 0; i < candidates.size(); i++) {
+      if (selected[i]) {
+        auto s1 = candidates[i].second->getLeftElement();
+        auto s2 = candidates[i].second->getRightElement();
+        if (verbose)
+          logs() << "[selectPacks] savings = " << candidates[i].first << ": ";
+        P.addPair(s1, s2);
+      }
+    }
+  }
+
+  // Branch and bound search over the candidates, used by selectPacks
+  void searchPacks(std::vector<std::pair<int, Pack *>> &candidates,
+                   unsigned int k, int savings, std::vector<bool> &current,
+                   std::vector<bool> &selected, int &best,
+                   std::map<Instruction *, Instruction *> &next,
+                   std::set<Instruction *> &packedInRight) {
+    // Candidates are sorted by savings, so the remaining ones can add at most
+    // this much
+    int bound = savings;
+    for (unsigned int i = k; i < candidates.size(); i++) {
+      bound += candidates[i].first;
+    }
+    if (bound <= best) {
+      return;
+    }
+    if (k == candidates.size()) {
+      best = savings;
+      selected = current;
+      return;
+    }
+
+    auto s1 = candidates[k].second->getLeftElement();
+    auto s2 = candidates[k].second->getRightElement();
+    if (canSelect(s1, s2, next, packedInRight)) {
+      next[s1] = s2;
+      packedInRight.insert(s2);
+      current[k] = true;
+      searchPacks(candidates, k + 1, savings + candidates[k].first, current,
+                  selected, best, next, packedInRight);
+      current[k] = false;
+      packedInRight.erase(s2);
+      next.erase(s1);
+    }
+    searchPacks(candidates, k + 1, savings, current, selected, best, next,
+                packedInRight);
+  }
+
+  bool followUseDefs(BasicBlock &BB, PackSet &P, Pack &p) {
+    bool changed = false;
+
+    Instruction *s1 = p.getLeftElement();
+    Instruction *s2 = p.getRightElement();
+    auto align_s1 = getAlignment(s1);
+    auto stride = getStride(s1, s2);
+    auto m = s1->getNumOperands();
+    assert(m == s2->getNumOperands());
+    // Pair operands of commutative statements in the order that matches best
+    bool swap = shouldCommute(s1, s2);
+    for (unsigned int j = 0; j < m; j++) {
+      Instruction *t1 = dyn_cast<Instruction>(s1->getOperand(j));
+      Instruction *t2 = dyn_cast<Instruction>(
+          getPairedOperand(s1, s2, (swap && j < 2) ? 1 - j : j));
+      if (!t1 || !t2) {
+        continue;
+      }
+      if (t1->getParent() == &BB && t2->getParent() == &BB) {
+        const char *reason = cannotPack(t1, t2, align_s1, stride);
+        if (reason == nullptr && !P.pairExists(t1, t2)) {
+          P.addPair(t1, t2);
+          setAlignment(t1, s1);
+          setAlignment(t2, s2);
+          changed = true;
+        } else if (reason != nullptr &&
+                   s1->getOperand(j) != getLoadStorePointerOperand(s1)) {
+          rejectedPairs.push_back(std::make_tuple(t1, t2, reason));
+        }
+      }
+    }
+
+    return changed;
+  }
+
+  // The operand of s2 paired with the operand j of s1: phis may list the
+  // same incoming blocks in a different order
+  Value *getPairedOperand(Instruction *s1, Instruction *s2, unsigned int j) {
+    if (auto phi = dyn_cast<PHINode>(s2)) {
+      return phi->getIncomingValueForBlock(
+          cast<PHINode>(s1)->getIncomingBlock(j));
+    }
+    return s2->getOperand(j);
+  }
+
+  bool followDefUses(BasicBlock &BB, PackSet &P, Pack &p) {
+    bool changed = false;
+
+    Instruction *s1 = p.getLeftElement();
+    Instruction *s2 = p.getRightElement();
+    auto align_s1 = getAlignment(s1);
+    auto stride = getStride(s1, s2);
+
+    // Every pair of users that can be packed is a candidate; selectPacks
+    // resolves the conflicts between them later
+    for (auto *s1User : s1->users()) {
+      Instruction *t1 = cast<Instruction>(s1User);
+      if (t1->getParent() != &BB) {
+        continue;
+      }
+      for (auto *s2User : s2->users()) {
+        Instruction *t2 = cast<Instruction>(s2User);
+        if (t2->getParent() != &BB) {
+          continue;
+        }
+        if (stmtsCanPack(BB, P, t1, t2, align_s1, stride) &&
+            !P.pairExists(t1, t2)) {
+          P.addPair(t1, t2);
+          setAlignment(t1, s1);
+          setAlignment(t2, s2);
+          changed = true;
+        }
+      }
+    }
+
+    return changed;
+  }
+
+  /*
+   * Score how well operand a (from one lane) matches operand b (from the next
+   * lane) when both sit in the same operand position of a pack:
+   *  3: adjacent loads, which become one contiguous vector load
+   *  2: the same value, which becomes a splat
+   *  1: isomorphic instructions or two constants, which may form a pack
+   *  0: anything else, which needs a per-lane insert
+   */
+  unsigned int operandMatchScore(Value *a, Value *b) {
+    if (a == b) {
+      return 2;
+    }
+    auto ia = dyn_cast<Instruction>(a);
+    auto ib = dyn_cast<Instruction>(b);
+    if (ia && ib) {
+      if (isa<LoadInst>(ia) && isa<LoadInst>(ib) && adjacent(ia, ib)) {
+        return 3;
+      }
+      return isIsomorphic(ia, ib) ? 1 : 0;
+    }
+    return (isa<Constant>(a) && isa<Constant>(b)) ? 1 : 0;
+  }
+
+  /*
+   * Check whether the operands of the commutative statement s should be
+   * swapped so that they line up with the operands of prev, the statement in
+   * the previous lane
+   */
+  bool shouldCommute(Instruction *prev, Instruction *s) {
+    if (!isa<BinaryOperator>(prev)) {
+      return false;
+    }
+    return shouldCommute(prev->getOperand(0), prev->getOperand(1), s);
+  }
+
+  // Same, where (a, b) are the operands of the previous lane
+  bool shouldCommute(Value *a, Value *b, Instruction *s) {
+    if (!isa<BinaryOperator>(s) || !s->isCommutative()) {
+      return false;
+    }
+    Value *c = s->getOperand(0);
+    Value *d = s->getOperand(1);
+    return operandMatchScore(a, d) + operandMatchScore(b, c) >
+           operandMatchScore(a, c) + operandMatchScore(b, d);
+  }
+
+  /*
+   * Reorder the operands of commutative packs lane by lane, so that every
+   * operand position holds a load pack, a splat, or isomorphic statements
+   * wherever possible. E.g.,
+   *   x0 = a * X[i + 0]          x0 = X[i + 0] * a
+   *   x1 = X[i + 1] * a    ->    x1 = X[i + 1] * a
+   */
+  void reorderOperands(PackSet &P) {
+    for (auto &p : P) {
+      for (unsigned int i = 1; i < p.getSize(); i++) {
+        Instruction *prev = p.getNthElement(i - 1);
+        Instruction *s = p.getNthElement(i);
+        if (shouldCommute(prev, s)) {
+          cast<BinaryOperator>(s)->swapOperands();
+          if (verbose)
+            logs() << "[reorderOperands] commute (" << *s << ")\n";
+        }
+      }
+    }
+  }
+
+  /*
+   * Combine the selected pairs into packs. The pairs form disjoint chains
+   * (every statement is the left element of at most one pair and the right
+   * element of at most one pair), so index them by their first element and
+   * follow the successor links once from every chain head. Chains longer than
+   * a vector register are then cut into packs of the legal vector width, so
+   * the packs of a block may have different widths, e.g. 4 + 2 lanes of a
+   * 6-lane chain, or float packs next to double packs.
+   */
+  void combinePacks(PackSet &P) {
+    std::map<Instruction *, Instruction *> next;
+    std::set<Instruction *> hasPrev;
+    for (auto &p : P) {
+      next[p.getLeftElement()] = p.getRightElement();
+      hasPrev.insert(p.getRightElement());
+    }
+
+    std::vector<std::vector<Instruction *>> chains;
+    for (auto &p : P) {
+      Instruction *s = p.getLeftElement();
+      if (hasPrev.find(s) != hasPrev.end()) {
+        continue;
+      }
+      std::vector<Instruction *> chain;
+      chain.push_back(s);
+      for (auto iter = next.find(s); iter != next.end();
+           iter = next.find(iter->second)) {
+        chain.push_back(iter->second);
+      }
+      chains.push_back(chain);
+    }
+
+    P.clear();
+    for (auto &chain : chains) {
+      unsigned int width = getMaxVecWidth(chain[0]);
+      for (unsigned int i = 0; i + 1 < chain.size(); i += width) {
+        unsigned int n = std::min<size_t>(width, chain.size() - i);
+        if (n < 2) {
+          break;
+        }
+        P.addChain(ArrayRef<Instruction *>(chain).slice(i, n));
+      }
+    }
+  }
+
+  // Number of lanes of the type of s that fit in a vector register
+  unsigned int getMaxVecWidth(Instruction *s) {
+    Type *type = s->getType();
+    if (auto storeInst = dyn_cast<StoreInst>(s)) {
+      type = storeInst->getValueOperand()->getType();
+    }
+    unsigned int bits = type->getPrimitiveSizeInBits();
+    if (bits == 0) {
+      bits = DL.getPointerSizeInBits();
+    }
+    return std::max(2u, SLPVectorBits / bits);
+  }
+
+  /*
+   * codeGen extracts a lane used outside the packs right before the last
+   * element of its pack, so the scalar statements between the lanes that use
+   * it are moved after the extraction, together with the scalar statements
+   * that use them in turn. Check that this is possible: the statements moved
+   * must not access memory or have side effects, and the packs using them
+   * must still come after them.
+   */
+  bool canSinkScalarUsers(BasicBlock &BB, PackSet &P) {
+    std::map<Instruction *, unsigned int> position;
+    unsigned int n = 0;
+    for (auto &s : BB) {
+      position[&s] = n++;
+    }
+
+    for (auto &pack : P) {
+      if (pack.getFirstElement()->getType()->isVoidTy()) {
+        continue;
+      }
+      unsigned int last = position[pack.getLastElement()];
+      std::vector<Instruction *> worklist(pack.begin(), pack.end());
+      std::set<Instruction *> sunk;
+      while (!worklist.empty()) {
+        Instruction *s = worklist.back();
+        worklist.pop_back();
+        for (auto user : s->users()) {
+          auto u = cast<Instruction>(user);
+          if (u->getParent() != &BB || isa<PHINode>(u)) {
+            continue;
+          }
+          // Store packs without a packed value stay scalar, see codeGen
+          if (Pack *userPack = P.findPack(u)) {
+            if (position[userPack->getLastElement()] > last &&
+                (!isa<StoreInst>(u) || P.hasDependency(userPack) ||
+                 isFill(P, userPack))) {
+              continue;
+            }
+          } else if (position[u] > last || !sunk.insert(u).second) {
+            continue;
+          }
+          // a packed statement before the extraction uses a moved statement
+          if (P.findPack(u) || u->mayReadOrWriteMemory() ||
+              u->mayHaveSideEffects()) {
+            logs() << "[canSinkScalarUsers] cannot move (" << *u << ")\n";
+            remark([&]() {
+              return OptimizationRemarkMissed(DEBUG_TYPE,
+                                              "ScalarUseBetweenLanes", u)
+                     << "not vectorized: " << ore::NV("Stmt", u)
+                     << " uses a packed value before its pack is complete";
+            });
+            return false;
+          }
+          worklist.push_back(u);
+        }
+      }
+    }
+    return true;
+  }
+
+  // Move s, and the scalar statements of the block that use it and now come
+  // before it, right after pos
+  void sinkAfter(Instruction *s, Instruction *pos, PackSet &P) {
+    s->moveAfter(pos);
+    for (auto user : s->users()) {
+      auto u = cast<Instruction>(user);
+      if (!isa<PHINode>(u) && u->getParent() == s->getParent() &&
+          P.findPack(u) == nullptr && u->comesBefore(s)) {
+        sinkAfter(u, s, P);
+      }
+    }
+  }
+
+  unsigned int getVectorRegisters() {
+    if (SLPVectorRegisters) {
+      return SLPVectorRegisters;
+    }
+    return TTI->getNumberOfRegisters(TTI->getRegisterClassForType(true));
+  }
+
+  /*
+   * Estimate the largest number of vectors live at once when P is generated
+   * in BB. codeGen emits the vector of a pack at its last element, where it
+   * stays live until the last pack that uses it; lanes used outside the packs
+   * are extracted right away. A vector built from scalar operands is reused
+   * by every pack with the same lanes, so it lives from the first of them to
+   * the last.
+   */
+  unsigned int estimatePressure(BasicBlock &BB, PackSet &P) {
+    std::map<Instruction *, unsigned int> position;
+    std::map<std::vector<Value *>, size_t> operandVectors;
+    std::vector<LiveVector> vectors =
+        getLiveVectors(BB, P, position, operandVectors);
+    unsigned int peakPosition;
+    unsigned int peak = getPeak(vectors, peakPosition);
+    if (verbose)
+      logs() << "[estimatePressure] " << peak << " live vectors in "
+             << BB.getName() << "\n";
+    return peak;
+  }
+
+  /*
+   * The vectors live when P is generated in BB, see estimatePressure.
+   * position is filled with the position of every statement of BB, and
+   * operandVectors with the index of every operand vector by its lanes.
+   */
+  std::vector<LiveVector>
+  getLiveVectors(BasicBlock &BB, PackSet &P,
+                 std::map<Instruction *, unsigned int> &position,
+                 std::map<std::vector<Value *>, size_t> &operandVectors) {
+    unsigned int n = 0;
+    for (auto &s : BB) {
+      position[&s] = n++;
+    }
+
+    std::vector<LiveVector> vectors;
+    for (auto &pack : P) {
+      unsigned int def = position[pack.getLastElement()];
+      if (!pack.getFirstElement()->getType()->isVoidTy()) {
+        LiveVector value(&pack, def);
+        for (auto s : pack) {
+          for (auto user : s->users()) {
+            if (Pack *userPack = P.findPack(cast<Instruction>(user))) {
+              // carried to the next iteration by a vector phi
+              value.uses[userPack] = isa<PHINode>(user)
+                                         ? n
+                                         : position[userPack->getLastElement()];
+            }
+          }
+        }
+        vectors.push_back(value);
+      }
+      addOperandVectors(P, pack, def, vectors, operandVectors);
+    }
+    return vectors;
+  }
+
+  // Add the operand vectors that pack, whose last element is at position def,
+  // builds from scalars to vectors
+  void
+  addOperandVectors(PackSet &P, Pack &pack, unsigned int def,
+                    std::vector<LiveVector> &vectors,
+                    std::map<std::vector<Value *>, size_t> &operandVectors) {
+    unsigned int m = getNumVectorOperands(pack.getFirstElement());
+    for (unsigned int j = 0; j < m; j++) {
+      std::vector<Value *> lanes = getOperandLanes(pack, j);
+      if (lanes.empty() || fromOnePack(P, lanes)) {
+        continue;
+      }
+      auto iter = operandVectors.find(lanes);
+      if (iter == operandVectors.end()) {
+        iter = operandVectors.insert(std::make_pair(lanes, vectors.size()))
+                   .first;
+        vectors.push_back(LiveVector(nullptr, def));
+      }
+      vectors[iter->second].uses[&pack] = def;
+    }
+  }
+
+  // The largest number of vectors live at once, and the first position where
+  // they are
+  unsigned int getPeak(const std::vector<LiveVector> &vectors,
+                       unsigned int &peakPosition) {
+    // A vector is free for reuse by the packs after its last use
+    std::vector<std::pair<unsigned int, int>> events;
+    for (auto &vector : vectors) {
+      auto range = vector.getRange();
+      if (range.first < range.second) {
+        events.push_back(std::make_pair(range.first, 1));
+        events.push_back(std::make_pair(range.second, -1));
+      }
+    }
+    std::sort(events.begin(), events.end());
+    int live = 0, peak = 0;
+    peakPosition = 0;
+    for (auto &event : events) {
+      live += event.second;
+      if (live > peak) {
+        peak = live;
+        peakPosition = event.first;
+      }
+    }
+    return peak;
+  }
+
+  /*
+   * Drop packs from P, whose pressure vectors are live at once, until they
+   * fit in the vector registers. Each time, of the packs keeping a vector
+   * live at the peak, drop the one whose removal lowers the peak and loses
+   * the least savings, or loses the least savings if no removal lowers the
+   * peak by itself. A pack loses its own savings and the lanes its users
+   * build their operand from instead.
+   *
+   * The live ranges, the number of vectors live at every position and the
+   * savings lost are computed once, and only updated for the packs next to
+   * a dropped one. The lanes of a dropped pack stay scalar, like those of a
+   * cut pack. Returns the pressure left.
+   */
+  unsigned int trimPacks(BasicBlock &BB, PackSet &P, unsigned int pressure) {
+    std::map<Instruction *, unsigned int> position;
+    std::map<std::vector<Value *>, size_t> operandVectors;
+    std::vector<LiveVector> vectors =
+        getLiveVectors(BB, P, position, operandVectors);
+
+    // The vectors every pack defines or uses
+    std::map<Pack *, SetVector<size_t>> vectorsOf;
+    for (size_t v = 0; v < vectors.size(); v++) {
+      if (vectors[v].pack) {
+        vectorsOf[vectors[v].pack].insert(v);
+      }
+      for (auto &use : vectors[v].uses) {
+        vectorsOf[use.first].insert(v);
+      }
+    }
+
+    std::set<Pack *> dropped;
+
+    // Savings lost by dropping a pack, ties broken by the order of the packs
+    std::map<Pack *, std::pair<int, unsigned int>> rank;
+    auto getLoss = [&](Pack *pack) {
+      std::set<std::vector<Value *>> built;
+      int loss = estimatePackSavings(P, *pack, built);
+      for (auto &gather :
+           getGathers(pack, vectors, vectorsOf, position, dropped)) {
+        loss += gather.first.size();
+      }
+      return loss;
+    };
+    unsigned int order = 0;
+    for (auto &pack : P) {
+      rank[&pack] = std::make_pair(getLoss(&pack), order++);
+    }
+
+    // Number of vectors live at every position
+    std::vector<int> live(position.size() + 1, 0);
+    auto addRange = [&](std::pair<unsigned int, unsigned int> range, int n) {
+      for (unsigned int i = range.first; i < range.second; i++) {
+        live[i] += n;
+      }
+    };
+    for (auto &vector : vectors) {
+      addRange(vector.getRange(), 1);
+    }
+
+    while (pressure > getVectorRegisters() && P.size() > 0) {
+      unsigned int peakPosition =
+          std::max_element(live.begin(), live.end()) - live.begin();
+      unsigned int peakCount = std::count(live.begin(), live.end(), pressure);
+
+      // Whether dropping pack lowers the peak: every position at the peak
+      // loses a vector, and no other position reaches it
+      auto lowers = [&](Pack *pack) {
+        std::map<unsigned int, int> delta;
+        auto change = [&](std::pair<unsigned int, unsigned int> range, int n) {
+          if (range.first < range.second) {
+            delta[range.first] += n;
+            delta[range.second] -= n;
+          }
+        };
+        for (auto v : vectorsOf[pack]) {
+          LiveVector after = vectors[v];
+          after.dropped |= after.pack == pack;
+          after.uses.erase(pack);
+          change(vectors[v].getRange(), -1);
+          change(after.getRange(), 1);
+        }
+        for (auto &gather : getGathers(pack, vectors, vectorsOf, position,
+                                       dropped)) {
+          change(gather.second.getRange(), 1);
+        }
+        int n = 0;
+        unsigned int lowered = 0, from = 0;
+        for (auto &step : delta) {
+          for (unsigned int i = from; n != 0 && i < step.first; i++) {
+            if (live[i] + n >= (int)pressure) {
+              return false;
+            }
+            lowered += live[i] == (int)pressure;
+          }
+          n += step.second;
+          from = step.first;
+        }
+        return lowered == peakCount;
+      };
+
+      Pack *drop = nullptr;
+      bool dropLowers = false;
+      std::set<Pack *> tried;
+      for (auto &vector : vectors) {
+        auto range = vector.getRange();
+        if (range.first > peakPosition || range.second <= peakPosition) {
+          continue;
+        }
+        std::vector<Pack *> keepLive;
+        if (vector.pack) {
+          keepLive.push_back(vector.pack);
+        } else {
+          for (auto &use : vector.uses) {
+            keepLive.push_back(use.first);
+          }
+        }
+        for (auto pack : keepLive) {
+          if (!tried.insert(pack).second) {
+            continue;
+          }
+          bool packLowers = lowers(pack);
+          if (drop == nullptr || (packLowers && !dropLowers) ||
+              (packLowers == dropLowers && rank[pack] < rank[drop])) {
+            drop = pack;
+            dropLowers = packLowers;
+          }
+        }
+      }
+
+      if (verbose)
+        logs() << "[trimPacks] " << *drop->getFirstElement() << "\n";
+      remark([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "RegisterPressure",
+                                        drop->getFirstElement())
+               << "not vectorized: the pack of "
+               << ore::NV("Stmt", drop->getFirstElement())
+               << " would not fit in the "
+               << ore::NV("Registers", getVectorRegisters())
+               << " vector registers";
+      });
+      NumTrimmedPacks++;
+      P.remove(*drop);
+      cutUncarried(P);
+
+      // Update the vectors of the dropped pack, and of the packs cut along
+      // with it
+      std::set<Pack *> kept;
+      for (auto &pack : P) {
+        kept.insert(&pack);
+      }
+      std::set<Pack *> neighbors;
+      for (auto &entry : rank) {
+        Pack *pack = entry.first;
+        if (kept.count(pack) || !dropped.insert(pack).second) {
+          continue;
+        }
+        for (auto v : vectorsOf[pack]) {
+          if (vectors[v].pack) {
+            neighbors.insert(vectors[v].pack);
+          }
+          for (auto &use : vectors[v].uses) {
+            neighbors.insert(use.first);
+          }
+        }
+        for (auto &gather :
+             getGathers(pack, vectors, vectorsOf, position, dropped)) {
+          auto iter = operandVectors.find(gather.first);
+          if (iter == operandVectors.end()) {
+            iter = operandVectors
+                       .insert(std::make_pair(gather.first, vectors.size()))
+                       .first;
+            vectors.push_back(LiveVector(nullptr, gather.second.def));
+          }
+          LiveVector &vector = vectors[iter->second];
+          addRange(vector.getRange(), -1);
+          for (auto &use : gather.second.uses) {
+            vector.uses.insert(use);
+            vectorsOf[use.first].insert(iter->second);
+          }
+          addRange(vector.getRange(), 1);
+        }
+        for (auto v : vectorsOf[pack]) {
+          addRange(vectors[v].getRange(), -1);
+          vectors[v].dropped |= vectors[v].pack == pack;
+          vectors[v].uses.erase(pack);
+          addRange(vectors[v].getRange(), 1);
+        }
+      }
+      for (auto pack : neighbors) {
+        if (dropped.count(pack) == 0) {
+          rank[pack].first = getLoss(pack);
+        }
+      }
+      pressure = *std::max_element(live.begin(), live.end());
+    }
+    return pressure;
+  }
+
+  /*
+   * The operand vectors built from scalars, by their lanes, once pack is
+   * dropped: the packs using the value of pack as one of their operands
+   * build it from its lanes instead
+   */
+  std::map<std::vector<Value *>, LiveVector>
+  getGathers(Pack *pack, std::vector<LiveVector> &vectors,
+             std::map<Pack *, SetVector<size_t>> &vectorsOf,
+             std::map<Instruction *, unsigned int> &position,
+             std::set<Pack *> &dropped) {
+    std::map<std::vector<Value *>, LiveVector> gathers;
+    for (auto v : vectorsOf[pack]) {
+      if (vectors[v].pack != pack) {
+        continue;
+      }
+      for (auto &use : vectors[v].uses) {
+        Pack *user = use.first;
+        if (dropped.count(user)) {
+          continue;
+        }
+        unsigned int def = position[user->getLastElement()];
+        unsigned int m = getNumVectorOperands(user->getFirstElement());
+        for (unsigned int j = 0; j < m; j++) {
+          std::vector<Value *> lanes = getOperandLanes(*user, j);
+          if (!std::equal(lanes.begin(), lanes.end(), pack->begin(),
+                          pack->end())) {
+            continue;
+          }
+          auto gather =
+              gathers.insert(std::make_pair(lanes, LiveVector(nullptr, def)))
+                  .first;
+          gather->second.uses[user] = def;
+        }
+      }
+    }
+    return gathers;
+  }
+
+  // Whether the vector v, built earlier in the block, can be used at insertPt
+  bool availableAt(Value *v, Instruction *insertPt) {
+    auto def = dyn_cast<Instruction>(v);
+    return !def || (def->getParent() == insertPt->getParent() &&
+                    def->comesBefore(insertPt));
+  }
+
+  // Whether the result of load is still what memory holds at insertPt
+  bool loadAvailableAt(LoadInst *load, Instruction *insertPt) {
+    if (!availableAt(load, insertPt)) {
+      return false;
+    }
+    MemoryLocation loc = MemoryLocation::get(load);
+    for (auto s = load->getNextNode(); s != insertPt; s = s->getNextNode()) {
+      if (isModSet(AA->getModRefInfo(s, loc))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether the independent stores of pack all write one value or constants
+  bool isFill(PackSet &P, Pack *pack) {
+    Value *first = cast<StoreInst>(pack->getFirstElement())->getValueOperand();
+    bool uniform = true, constant = true;
+    for (auto s : *pack) {
+      Value *value = cast<StoreInst>(s)->getValueOperand();
+      uniform &= value == first;
+      constant &= isa<Constant>(value);
+    }
+    auto def = dyn_cast<Instruction>(first);
+    return constant || (uniform && (!def || P.findPack(def) == nullptr));
+  }
+
+  // The load pack whose lanes the store pack writes in the same order
+  Pack *getCopiedPack(PackSet &P, Pack *pack) {
+    auto first = dyn_cast<LoadInst>(
+        cast<StoreInst>(pack->getFirstElement())->getValueOperand());
+    Pack *loadPack = first ? P.findPack(first) : nullptr;
+    if (!loadPack || loadPack->getSize() != pack->getSize()) {
+      return nullptr;
+    }
+    for (size_t i = 0; i < pack->getSize(); i++) {
+      if (cast<StoreInst>(pack->getNthElement(i))->getValueOperand() !=
+          loadPack->getNthElement(i)) {
+        return nullptr;
+      }
+    }
+    return loadPack;
+  }
+
+  /*
+   * Whether every memory access of the block of P is a lane of a store pack
+   * that fills memory or copies a load pack, or a lane of such a load pack
+   * that is only stored, as in the unrolled body of a memset or memcpy loop
+   */
+  bool isCopyOrFillBlock(PackSet &P) {
+    if (P.lbegin() == P.lend()) {
+      return false;
+    }
+    BasicBlock *BB = (*P.lbegin())->getFirstElement()->getParent();
+    for (auto &s : *BB) {
+      if (!s.mayReadOrWriteMemory()) {
+        continue;
+      }
+      Pack *pack = P.findPack(&s);
+      if (pack == nullptr) {
+        return false;
+      }
+      if (isa<LoadInst>(&s)) {
+        for (auto user : s.users()) {
+          auto store = dyn_cast<StoreInst>(user);
+          if (!store || store->getValueOperand() != &s ||
+              P.findPack(store) == nullptr) {
+            return false;
+          }
+        }
+      } else if (!isa<StoreInst>(&s) ||
+                 (!isFill(P, pack) && !getCopiedPack(P, pack))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*
+   * Emit the contiguous store pack of a copy or fill block as llvm.memcpy or
+   * llvm.memset of the same bytes. Backends lower a small memory intrinsic to
+   * the same vector load and store, but loop idiom recognition and memcpyopt
+   * can then turn the whole loop into one bulk call. Returns nullptr when the
+   * stored value is not a repeated byte, or when the source of a copy may
+   * overlap its destination or be written before the last lane.
+   */
+  CallInst *createMemTransfer(IRBuilder<> &builder, PackSet &P, Pack *pack) {
+    auto firstStore = cast<StoreInst>(pack->getFirstElement());
+    Type *type = firstStore->getValueOperand()->getType();
+    if (getStride(pack) != 1 ||
+        DL.getTypeStoreSize(type) != DL.getTypeAllocSize(type)) {
+      return nullptr;
+    }
+    uint64_t size = DL.getTypeStoreSize(type) * pack->getSize();
+    Value *dest = firstStore->getPointerOperand();
+
+    if (Pack *loadPack = getCopiedPack(P, pack)) {
+      auto firstLoad = cast<LoadInst>(loadPack->getFirstElement());
+      auto load = dyn_cast<LoadInst>(loadPack->getValue());
+      if (getStride(loadPack) != 1 || !load ||
+          !loadAvailableAt(load, pack->getLastElement()) ||
+          !AA->isNoAlias(MemoryLocation(dest, LocationSize::precise(size)),
+                         MemoryLocation::get(load))) {
+        return nullptr;
+      }
+      return builder.CreateMemCpy(dest, firstStore->getAlign(),
+                                  firstLoad->getPointerOperand(),
+                                  firstLoad->getAlign(), size);
+    }
+
+    Value *byte = nullptr;
+    for (auto s : *pack) {
+      Value *lane = isBytewiseValue(cast<StoreInst>(s)->getValueOperand(), DL);
+      if (!lane || (byte && lane != byte)) {
+        return nullptr;
+      }
+      byte = lane;
+    }
+    return builder.CreateMemSet(dest, byte, size, firstStore->getAlign());
+  }
+
+  // Whether codeGen can emit the vector form of pack
+  bool canGenerate(Pack &pack) {
+    Instruction *first = pack.getFirstElement();
+    if (isa<LoadInst>(first) || isa<StoreInst>(first) ||
+        isa<BinaryOperator>(first) || isa<PHINode>(first)) {
+      return true;
+    }
+    if (auto intrinsic = dyn_cast<IntrinsicInst>(first)) {
+      return isTriviallyVectorizable(intrinsic->getIntrinsicID()) &&
+             VectorType::isValidElementType(first->getType());
+    }
+    return false;
+  }
+
+  /*
+   * Cut the packs that codeGen cannot emit out of P. Their lanes stay scalar
+   * and become the boundary of the vector code: packs that use them insert
+   * the lanes into a vector, and the lanes that use packed values extract
+   * them, like for any other statement outside the packs.
+   */
+  void cutUnsupported(PackSet &P) {
+    std::vector<Pack *> unsupported;
+    for (auto &pack : P) {
+      if (!canGenerate(pack)) {
+        unsupported.push_back(&pack);
+      }
+    }
+    for (auto pack : unsupported) {
+      if (verbose)
+        logs() << "[cutUnsupported] " << *pack->getFirstElement() << "\n";
+      remarkUnsupported(pack);
+      P.remove(*pack);
+    }
+    cutUncarried(P);
+  }
+
+  /*
+   * A pack of phis is generated as a vector phi, which the block itself only
+   * feeds if the values carried around the loop form a pack of P, in the
+   * same lane order
+   */
+  bool isCarried(PackSet &P, Pack &pack) {
+    auto first = cast<PHINode>(pack.getFirstElement());
+    BasicBlock *BB = first->getParent();
+    if (first->getBasicBlockIndex(BB) < 0) {
+      return false;
+    }
+    auto carried =
+        dyn_cast<Instruction>(first->getIncomingValueForBlock(BB));
+    Pack *carriedPack = carried ? P.findPack(carried) : nullptr;
+    if (carriedPack == nullptr || carriedPack->getSize() != pack.getSize()) {
+      return false;
+    }
+    for (size_t i = 0; i < pack.getSize(); i++) {
+      auto phi = cast<PHINode>(pack.getNthElement(i));
+      if (phi->getIncomingValueForBlock(BB) != carriedPack->getNthElement(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Cut the packs of phis whose carried values are not packed, see isCarried()
+  void cutUncarried(PackSet &P) {
+    std::vector<Pack *> uncarried;
+    for (auto &pack : P) {
+      if (isa<PHINode>(pack.getFirstElement()) && !isCarried(P, pack)) {
+        uncarried.push_back(&pack);
+      }
+    }
+    for (auto pack : uncarried) {
+      if (verbose)
+        logs() << "[cutUncarried] " << *pack->getFirstElement() << "\n";
+      remark([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "UncarriedPhi",
+                                        pack->getFirstElement())
+               << "cannot generate vector code for "
+               << ore::NV("Stmt", pack->getFirstElement())
+               << ": the values it carries around the loop are not packed";
+      });
+      P.remove(*pack);
+    }
+  }
+
+  // Number of operands of s that are vectors in its vector form
+  unsigned int getNumVectorOperands(Instruction *s) {
+    if (isa<LoadInst>(s)) {
+      return 0;
+    }
+    if (isa<StoreInst>(s)) {
+      return 1;
+    }
+    if (auto call = dyn_cast<CallInst>(s)) {
+      return call->arg_size();
+    }
+    return s->getNumOperands();
+  }
+
+  /*
+   * The values of the operand j of every lane of pack, in the order
+   * reorderOperands() will give them, or an empty vector when the operand
+   * stays scalar in the vector form or is built before the loop of a phi
+   */
+  std::vector<Value *> getOperandLanes(Pack &pack, unsigned int j) {
+    auto intrinsic = dyn_cast<IntrinsicInst>(pack.getFirstElement());
+    if (intrinsic &&
+        hasVectorInstrinsicScalarOpd(intrinsic->getIntrinsicID(), j)) {
+      return {};
+    }
+    std::vector<Value *> lanes;
+    if (auto first = dyn_cast<PHINode>(pack.getFirstElement())) {
+      BasicBlock *incoming = first->getIncomingBlock(j);
+      if (incoming != first->getParent()) {
+        return {};
+      }
+      for (auto s : pack) {
+        lanes.push_back(cast<PHINode>(s)->getIncomingValueForBlock(incoming));
+      }
+      return lanes;
+    }
+    Value *a = nullptr, *b = nullptr;
+    for (auto s : pack) {
+      bool swap = a && j < 2 && shouldCommute(a, b, s);
+      lanes.push_back(s->getOperand(swap ? 1 - j : j));
+      if (s->getNumOperands() >= 2) {
+        a = s->getOperand(swap ? 1 : 0);
+        b = s->getOperand(swap ? 0 : 1);
+      }
+    }
+    return lanes;
+  }
+
+  // Whether the lanes are the lanes of one pack of P, in the same order
+  bool fromOnePack(PackSet &P, const std::vector<Value *> &lanes) {
+    Pack *operandPack = nullptr;
+    for (size_t i = 0; i < lanes.size(); i++) {
+      auto def = dyn_cast<Instruction>(lanes[i]);
+      Pack *lanePack = def ? P.findPack(def) : nullptr;
+      if (!lanePack || (operandPack && lanePack != operandPack) ||
+          lanePack->getSize() != lanes.size() ||
+          lanePack->getNthElement(i) != def) {
+        return false;
+      }
+      operandPack = lanePack;
+    }
+    return true;
+  }
+
+  // Whether s is an associative and commutative operation, whose operands a
+  // horizontal reduction may reorder
+  bool isReducible(Instruction *s) {
+    switch (s->getOpcode()) {
+    case Instruction::Add:
+    case Instruction::Mul:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+      return true;
+    case Instruction::FAdd:
+    case Instruction::FMul:
+      return s->hasAllowReassoc();
+    }
+    if (auto intrinsic = dyn_cast<IntrinsicInst>(s)) {
+      switch (intrinsic->getIntrinsicID()) {
+      case Intrinsic::smin:
+      case Intrinsic::smax:
+      case Intrinsic::umin:
+      case Intrinsic::umax:
+      case Intrinsic::minnum:
+      case Intrinsic::maxnum:
+        return true;
+      default:
+        break;
+      }
+    }
+    return false;
+  }
+
+  // Whether v is a statement of the same reducible operation as node, in the
+  // same block and outside P
+  bool isReductionNode(Instruction *node, Value *v, PackSet &P) {
+    auto s = dyn_cast<Instruction>(v);
+    if (!s || !isReducible(s) || s->getOpcode() != node->getOpcode() ||
+        s->getType() != node->getType() ||
+        s->getParent() != node->getParent() || P.findPack(s) != nullptr) {
+      return false;
+    }
+    auto intrinsic = dyn_cast<IntrinsicInst>(s);
+    return !intrinsic || intrinsic->getIntrinsicID() ==
+                             cast<IntrinsicInst>(node)->getIntrinsicID();
+  }
+
+  /*
+   * The root of the reduction tree that the only use of s feeds: the
+   * outermost of a chain of the same reducible operation, every one but the
+   * root used once, or nullptr
+   */
+  Instruction *reductionRoot(Instruction *s, PackSet &P) {
+    if (!s->hasOneUse()) {
+      return nullptr;
+    }
+    auto root = cast<Instruction>(*s->user_begin());
+    if (!isReducible(root) || root->getParent() != s->getParent() ||
+        P.findPack(root) != nullptr) {
+      return nullptr;
+    }
+    while (root->hasOneUse() &&
+           isReductionNode(root, *root->user_begin(), P)) {
+      root = cast<Instruction>(*root->user_begin());
+    }
+    return root;
+  }
+
+  /*
+   * Find the horizontal reduction of pack: a scalar tree of one reducible
+   * operation, e.g. (e + f) + (g + h), whose leaves are exactly the lanes of
+   * pack. Returns its root and fills nodes with its statements, or returns
+   * nullptr. codeGen replaces the tree with one vector reduction.
+   */
+  Instruction *findReduction(PackSet &P, Pack &pack,
+                             std::vector<Instruction *> &nodes) {
+    nodes.clear();
+    Instruction *root = reductionRoot(pack.getFirstElement(), P);
+    if (root == nullptr) {
+      return nullptr;
+    }
+    unsigned int leaves = 0;
+    std::vector<Instruction *> worklist = {root};
+    while (!worklist.empty()) {
+      Instruction *node = worklist.back();
+      worklist.pop_back();
+      nodes.push_back(node);
+      for (unsigned int j = 0; j < 2; j++) {
+        Value *operand = node->getOperand(j);
+        if (operand->hasOneUse() && isReductionNode(root, operand, P)) {
+          worklist.push_back(cast<Instruction>(operand));
+        } else if (operand->hasOneUse() &&
+                   std::find(pack.begin(), pack.end(), operand) !=
+                       pack.end()) {
+          leaves++;
+        } else {
+          return nullptr;
+        }
+      }
+    }
+    return leaves == pack.getSize() ? root : nullptr;
+  }
+
+  // Reduce the lanes of vec with the operation of the tree rooted at root
+  Value *createReduction(IRBuilder<> &builder, Instruction *root, Value *vec) {
+    if (auto intrinsic = dyn_cast<IntrinsicInst>(root)) {
+      switch (intrinsic->getIntrinsicID()) {
+      case Intrinsic::smin:
+        return builder.CreateIntMinReduce(vec, true);
+      case Intrinsic::smax:
+        return builder.CreateIntMaxReduce(vec, true);
+      case Intrinsic::umin:
+        return builder.CreateIntMinReduce(vec, false);
+      case Intrinsic::umax:
+        return builder.CreateIntMaxReduce(vec, false);
+      case Intrinsic::minnum:
+        return builder.CreateFPMinReduce(vec);
+      case Intrinsic::maxnum:
+        return builder.CreateFPMaxReduce(vec);
+      default:
+        llvm_unreachable("not a reducible intrinsic");
+      }
+    }
+    switch (root->getOpcode()) {
+    case Instruction::Add:
+      return builder.CreateAddReduce(vec);
+    case Instruction::Mul:
+      return builder.CreateMulReduce(vec);
+    case Instruction::And:
+      return builder.CreateAndReduce(vec);
+    case Instruction::Or:
+      return builder.CreateOrReduce(vec);
+    case Instruction::Xor:
+      return builder.CreateXorReduce(vec);
+    case Instruction::FAdd:
+      // unordered, since every node of the tree allows reassociation
+      return builder.CreateFAddReduce(
+          ConstantFP::getNegativeZero(root->getType()), vec);
+    case Instruction::FMul:
+      return builder.CreateFMulReduce(ConstantFP::get(root->getType(), 1.0),
+                                      vec);
+    default:
+      llvm_unreachable("not a reducible operation");
+    }
+  }
+
+  /*
+   * The statements of a reduction of size lanes with the operation of root:
+   * what the target charges for it, e.g. one addv on AArch64, or a shuffle
+   * and an operation per halving of the vector
+   */
+  int getReductionCost(Instruction *root, unsigned int size) {
+    auto vecType = FixedVectorType::get(root->getType(), size);
+    InstructionCost cost;
+    if (auto intrinsic = dyn_cast<IntrinsicInst>(root)) {
+      auto condType = FixedVectorType::get(
+          Type::getInt1Ty(root->getContext()), size);
+      cost = TTI->getMinMaxReductionCost(
+          vecType, condType,
+          intrinsic->getIntrinsicID() == Intrinsic::umin ||
+              intrinsic->getIntrinsicID() == Intrinsic::umax,
+          TargetTransformInfo::TCK_RecipThroughput);
+    } else {
+      Optional<FastMathFlags> FMF;
+      if (isa<FPMathOperator>(root)) {
+        FMF = root->getFastMathFlags();
+      }
+      cost = TTI->getArithmeticReductionCost(
+          root->getOpcode(), vecType, FMF,
+          TargetTransformInfo::TCK_RecipThroughput);
+    }
+    if (!cost.isValid()) {
+      return 2 * Log2_32_Ceil(size);
+    }
+    return *cost.getValue();
+  }
+
+  /*
+   * Estimate the statements saved by generating P. Every pack replaces its
+   * lanes with one vector statement. A vector built from scalars costs one
+   * insertelement per lane, a broadcast for a splat and nothing for
+   * constants, once for all the packs with the same lanes. Every packed lane
+   * used outside the packs costs an extractelement, and strided accesses a
+   * shuffle. A horizontal reduction replaces the scalar tree of its lanes
+   * with the reduction of the target, see getReductionCost.
+   */
+  int estimateBlockSavings(PackSet &P) {
+    int savings = 0;
+    std::set<std::vector<Value *>> built;
+    for (auto &pack : P) {
+      savings += estimatePackSavings(P, pack, built);
+    }
+    if (verbose)
+      logs() << "[estimateBlockSavings] " << savings << "\n";
+    return savings;
+  }
+
+  // The statements saved by pack, see estimateBlockSavings, where built holds
+  // the operand vectors already built by other packs
+  int estimatePackSavings(PackSet &P, Pack &pack,
+                          std::set<std::vector<Value *>> &built) {
+    int savings = pack.getSize() - 1;
+    if (pack.getFirstElement()->mayReadOrWriteMemory() &&
+        getStride(&pack) > 1) {
+      savings--;
+    }
+
+    unsigned int m = getNumVectorOperands(pack.getFirstElement());
+    for (unsigned int j = 0; j < m; j++) {
+      std::vector<Value *> lanes = getOperandLanes(pack, j);
+      if (lanes.empty() || fromOnePack(P, lanes) ||
+          !built.insert(lanes).second) {
+        continue;
+      }
+      if (std::all_of(lanes.begin(), lanes.end(),
+                      [](Value *v) { return isa<Constant>(v); })) {
+        continue;
+      }
+      bool splat = std::all_of(lanes.begin(), lanes.end(),
+                               [&](Value *v) { return v == lanes[0]; });
+      savings -= splat ? 1 : lanes.size();
+    }
+
+    std::vector<Instruction *> nodes;
+    if (Instruction *root = findReduction(P, pack, nodes)) {
+      return savings + nodes.size() - getReductionCost(root, pack.getSize());
+    }
+    for (auto s : pack) {
+      for (auto user : s->users()) {
+        if (P.findPack(cast<Instruction>(user)) == nullptr &&
+            !isExtractedAfter(cast<Instruction>(user), s->getParent())) {
+          savings--;
+          break;
+        }
+      }
+    }
+    return savings;
+  }
+
+  /*
+   * Whether user, which uses a packed lane of BB, is a phi of a block entered
+   * from one block only, like the exit of a loop: codeGen extracts the lane
+   * there, after the loop, instead of in every iteration
+   */
+  bool isExtractedAfter(Instruction *user, BasicBlock *BB) {
+    auto phi = dyn_cast<PHINode>(user);
+    return phi && phi->getParent() != BB && phi->getNumIncomingValues() == 1;
+  }
+
+  void remarkUnsupported(Pack *pack) {
+    remark([&]() {
+      return OptimizationRemarkMissed(DEBUG_TYPE, "UnsupportedOpcode",
+                                      pack->getFirstElement())
+             << "cannot generate vector code for "
+             << ore::NV("Opcode", pack->getFirstElement()->getOpcodeName());
+    });
+  }
+
+  /*
+   * Group the strided memory packs of P into interleave groups, one pack per
+   * field. Loads whose lanes are not evenly spaced are gathered from their
+   * scalar lanes, and stores that are not evenly spaced or do not form a
+   * complete group are kept scalar.
+   */
+  void findInterleaveGroups(PackSet &P,
+                            std::vector<std::unique_ptr<StridedGroup>> &groups,
+                            std::map<Pack *, StridedGroup *> &groupOf,
+                            std::set<Pack *> &gatherPacks,
+                            std::set<Pack *> &scalarPacks) {
+    std::vector<Pack *> strided;
+    for (auto iter = P.lbegin(); iter != P.lend(); iter++) {
+      Pack *p = *iter;
+      bool isLoad = isa<LoadInst>(p->getFirstElement());
+      if (!isLoad && !isa<StoreInst>(p->getFirstElement())) {
+        continue;
+      }
+      unsigned int stride = getStride(p);
+      if (stride == 0) {
+        (isLoad ? gatherPacks : scalarPacks).insert(p);
+      } else if (stride > 1) {
+        strided.push_back(p);
+      }
+    }
 
-    Instruction *s1 = p.getLeftElement();
-    Instruction *s2 = p.getRightElement();
-    auto align_s1 = getAlignment(s1);
-    auto align_s2 = getAlignment(s2);
-    auto m = s1->getNumOperands();
-    assert(m == s2->getNumOperands());
-    for (unsigned int j = 0; j < m; j++) {
-      Instruction *t1 = dyn_cast<Instruction>(s1->getOperand(j));
-      Instruction *t2 = dyn_cast<Instruction>(s2->getOperand(j));
-      if (!t1 || !t2) {
+    for (auto p : strided) {
+      if (groupOf.find(p) != groupOf.end()) {
         continue;
       }
-      if (t1->getParent() == &BB && t2->getParent() == &BB) {
-        if (stmtsCanPack(BB, P, t1, t2, align_s1)) {
-          if (estSavings(t1, t2, P) >= 0) {
-            P.addPair(t1, t2);
-            setAlignment(t1, s1);
-            setAlignment(t2, s2);
-            changed = true;
-          }
+      unsigned int stride = getStride(p);
+      AlignInfo *align = getAlignment(p->getFirstElement());
+
+      // Collect the packs of the other fields, and the start of the group
+      std::vector<Pack *> members;
+      int64_t start = align->index;
+      for (auto q : strided) {
+        AlignInfo *qAlign = getAlignment(q->getFirstElement());
+        int64_t distance = qAlign->index - align->index;
+        if (q->getOpcode() == p->getOpcode() &&
+            q->getSize() == p->getSize() && getStride(q) == stride &&
+            groupOf.find(q) == groupOf.end() && qAlign->base == align->base &&
+            qAlign->offset == align->offset && qAlign->size == align->size &&
+            distance % (int64_t)align->size == 0 &&
+            std::abs(distance) < (int64_t)(stride * align->size)) {
+          members.push_back(q);
+          start = std::min(start, qAlign->index);
         }
       }
-    }
 
-    return changed;
-  }
+      auto group = std::make_unique<StridedGroup>(stride);
+      std::vector<Instruction *> lanes;
+      bool complete = members.size() == stride;
+      for (auto q : members) {
+        int64_t field =
+            (getAlignment(q->getFirstElement())->index - start) / align->size;
+        if (field >= stride || group->fields[field] != nullptr) {
+          complete = false;
+          break;
+        }
+        group->fields[field] = q;
+        lanes.insert(lanes.end(), q->begin(), q->end());
+      }
 
-  bool followDefUses(BasicBlock &BB, PackSet &P, Pack p) {
-    bool changed = false;
+      bool isLoad = isa<LoadInst>(p->getFirstElement());
+      if (complete && canAccessTogether(lanes, !isLoad)) {
+        for (auto q : members) {
+          groupOf[q] = group.get();
+        }
+        groups.push_back(std::move(group));
+        if (verbose)
+          logs() << "[findInterleaveGroups] stride " << stride << " group of "
+                 << members.size() << " packs at (" << *p->getFirstElement()
+                 << ")\n";
+      } else if (!isLoad) {
+        scalarPacks.insert(p);
+      }
+    }
+  }
 
-    int savings = -1;
+  /*
+   * Whether the memory accessed by s and t may overlap. Accesses through
+   * different base pointers are disjoint, or checked to be by versionBlock.
+   */
+  bool mayOverlap(Instruction *s, Instruction *t) {
+    AlignInfo *a = getAlignment(s);
+    AlignInfo *b = getAlignment(t);
+    if (a == nullptr || b == nullptr) {
+      return true;
+    }
+    if (a->base != b->base) {
+      return false;
+    }
+    if (a->offset != b->offset) {
+      return true;
+    }
+    return a->index < b->index + (int64_t)b->size &&
+           b->index < a->index + (int64_t)a->size;
+  }
 
-    Instruction *s1 = p.getLeftElement();
-    Instruction *s2 = p.getRightElement();
-    auto align_s1 = getAlignment(s1);
-    auto align_s2 = getAlignment(s2);
-    Instruction *t1 = nullptr;
-    Instruction *t2 = nullptr;
-    Instruction *u1 = nullptr;
-    Instruction *u2 = nullptr;
+  /*
+   * Check whether the store packs that codeGen keeps scalar, see
+   * findInterleaveGroups, can all be moved to the last lane of their pack,
+   * where the values they store are extracted: no other access between a
+   * lane and the last one may touch the memory the lane stores to
+   */
+  bool canKeepScalarStores(PackSet &P) {
+    std::vector<std::unique_ptr<StridedGroup>> groups;
+    std::map<Pack *, StridedGroup *> groupOf;
+    std::set<Pack *> gatherPacks, scalarPacks;
+    findInterleaveGroups(P, groups, groupOf, gatherPacks, scalarPacks);
 
-    for (auto *s1User : s1->users()) {
-      t1 = cast<Instruction>(s1User);
-      if (t1->getParent() != &BB) {
-        continue;
-      }
-      for (auto *s2User : s2->users()) {
-        t2 = cast<Instruction>(s2User);
-        if (t2->getParent() != &BB) {
+    for (auto pack : scalarPacks) {
+      Instruction *last = pack->getLastElement();
+      for (auto s : *pack) {
+        if (s == last) {
           continue;
         }
-        if (stmtsCanPack(BB, P, t1, t2, align_s1)) {
-          if (estSavings(t1, t2, P) > savings) {
-            savings = estSavings(t1, t2, P);
-            u1 = t1;
-            u2 = t2;
+        Instruction *from = s->comesBefore(last) ? s : last;
+        Instruction *to = s->comesBefore(last) ? last : s;
+        for (auto t = from->getNextNode(); t != to; t = t->getNextNode()) {
+          if (t->mayReadOrWriteMemory() && mayOverlap(s, t)) {
+            logs() << "[canKeepScalarStores] cannot move (" << *s
+                   << ") past (" << *t << ")\n";
+            remark([&]() {
+              return OptimizationRemarkMissed(DEBUG_TYPE,
+                                              "ScalarStoreNotMovable", s)
+                     << "not vectorized: " << ore::NV("Stmt", s)
+                     << " stays scalar but cannot be moved past "
+                     << ore::NV("Other", t);
+            });
+            return false;
           }
         }
       }
     }
+    return true;
+  }
 
-    if (savings >= 0) {
-      P.addPair(u1, u2);
-      setAlignment(u1, s1);
-      setAlignment(u2, s2);
-      changed = true;
+  /*
+   * Check whether no other instruction between the first and the last of the
+   * lanes may write memory (or, for stores, access memory at all), so that
+   * all the lanes can be accessed at one point
+   */
+  bool canAccessTogether(std::vector<Instruction *> &lanes, bool isStore) {
+    std::set<Instruction *> laneSet(lanes.begin(), lanes.end());
+    Instruction *first = lanes[0];
+    Instruction *last = lanes[0];
+    for (auto s : lanes) {
+      first = s->comesBefore(first) ? s : first;
+      last = last->comesBefore(s) ? s : last;
     }
+    for (auto iter = first->getIterator(); &*iter != last; iter++) {
+      if (laneSet.find(&*iter) != laneSet.end()) {
+        continue;
+      }
+      if (isStore ? iter->mayReadOrWriteMemory() : iter->mayWriteToMemory()) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-    return changed;
+  /*
+   * The alignment that the vector access by the memory pack starting with s
+   * can claim: the one known for its address, and at least the one of its
+   * first scalar lane. The internal globals it accesses are aligned to the
+   * vector width later, at module level, see alignGlobals().
+   */
+  Align getVectorAlignment(Instruction *s) {
+    Value *ptr = getLoadStorePointerOperand(s);
+    Align scalarAlign = isa<LoadInst>(s) ? cast<LoadInst>(s)->getAlign()
+                                         : cast<StoreInst>(s)->getAlign();
+    return std::max(getKnownAlignment(ptr, DL), scalarAlign);
   }
 
-  void combinePacks(PackSet &P) {
-    bool changed;
-    do {
-      changed = false;
-      for (auto pi1 = P.begin(); pi1 != P.end(); pi1++) {
-        for (auto pi2 = P.begin(); pi2 != P.end(); pi2++) {
-          Pack p1 = *pi1;
-          Pack p2 = *pi2;
-          if (&p1 == &p2) {
-            continue;
-          }
-          if (p1.getLastElement() == p2.getFirstElement()) {
-            P.addCombination(p1, p2);
-            P.remove(p1);
-            P.remove(p2);
-            changed = true;
-            break;
-          }
-        }
-        if (changed) {
-          break;
-        }
+  /*
+   * Load the strided lanes of pack: split its field out of the wide load of
+   * its interleave group, or out of a load of its own span of memory when it
+   * has no group
+   */
+  Value *loadInterleaved(IRBuilder<> &builder, Pack *pack, unsigned int stride,
+                         StridedGroup *group) {
+    Type *type = pack->getType();
+    unsigned int vecWidth = pack->getVecWidth();
+    auto firstLoad = cast<LoadInst>(pack->getFirstElement());
+    Instruction *insertPt = &*builder.GetInsertPoint();
+
+    unsigned int field = 0;
+    Value *wide = nullptr;
+    if (group) {
+      auto groupLoad = cast<LoadInst>(group->fields[0]->getFirstElement());
+      auto groupPtr = dyn_cast<Instruction>(groupLoad->getPointerOperand());
+      if (group->wide &&
+          cast<Instruction>(group->wide)->comesBefore(insertPt)) {
+        field = group->getField(pack);
+        wide = group->wide;
+      } else if (!groupPtr || groupPtr->comesBefore(insertPt)) {
+        field = group->getField(pack);
+        auto wideType = FixedVectorType::get(type, stride * vecWidth);
+        auto widePtr = builder.CreateBitCast(groupLoad->getPointerOperand(),
+                                             PointerType::get(wideType, 0));
+        wide = builder.CreateAlignedLoad(
+            wideType, widePtr, getVectorAlignment(groupLoad));
+        group->wide = wide;
+        logs() << "\t" << *wide << "\n";
       }
-    } while (changed);
+    }
+    if (wide == nullptr) {
+      auto wideType = FixedVectorType::get(type, stride * (vecWidth - 1) + 1);
+      auto widePtr = builder.CreateBitCast(firstLoad->getPointerOperand(),
+                                           PointerType::get(wideType, 0));
+      wide = builder.CreateAlignedLoad(
+          wideType, widePtr, getVectorAlignment(firstLoad));
+      logs() << "\t" << *wide << "\n";
+    }
+
+    return builder.CreateShuffleVector(
+        wide, UndefValue::get(wide->getType()),
+        createStrideMask(field, stride, vecWidth));
+  }
+
+  /*
+   * Store all the fields of an interleave group: concatenate their vectors,
+   * interleave them with one shufflevector, and store the result at the
+   * position of the last lane of the group
+   */
+  void storeInterleaved(StridedGroup *group) {
+    IRBuilder<> builder(group->getLastLane());
+    unsigned int vecWidth = group->fields[0]->getVecWidth();
+    auto groupStore = cast<StoreInst>(group->fields[0]->getFirstElement());
+
+    Value *wide = concatenateVectors(builder, group->values);
+    Value *interleaved = builder.CreateShuffleVector(
+        wide, UndefValue::get(wide->getType()),
+        createInterleaveMask(vecWidth, group->stride));
+    auto widePtr = builder.CreateBitCast(
+        groupStore->getPointerOperand(),
+        PointerType::get(interleaved->getType(), 0));
+    auto store = builder.CreateAlignedStore(
+        interleaved, widePtr,
+        getVectorAlignment(groupStore));
+
+    logs() << "\t" << *interleaved << "\n";
+    logs() << "\t" << *store << "\n";
   }
 
   /*
@@ -411,8 +3180,13 @@ public:
       - else
         - return pack's llvm vec
     */
-    auto getOperandVec = [](IRBuilder<> &builder, PackSet &P, Pack *pack,
-                            int operandNum) {
+    // Vector value numbering: the vectors built so far in the block, keyed by
+    // their ordered lanes (operand values, or addresses of loaded lanes)
+    std::map<std::vector<Value *>, Value *> operandVecs;
+    std::map<std::vector<Value *>, LoadInst *> vectorLoads;
+
+    auto getOperandVec = [&](IRBuilder<> &builder, PackSet &P, Pack *pack,
+                             int operandNum) -> Value * {
       // determine if all operands comes from same pack
       bool fromSamePack = true;
       Pack *samePack = nullptr;
@@ -425,7 +3199,11 @@ public:
           // get the pack which defines this operand
           Pack *operandPack = P.findPack(def);
 
-          if (operandPack == nullptr) {
+          // the operand pack must hold the operands in the same lanes, packs
+          // of another width are taken apart like any other
+          if (operandPack == nullptr ||
+              operandPack->getSize() != pack->getSize() ||
+              operandPack->getNthElement(packIter - pack->begin()) != def) {
             fromSamePack = false;
             break;
           }
@@ -457,6 +3235,19 @@ public:
 
       // not from same pack, so need to prepack operands
       else {
+        // reuse the same lanes if another pack already built them
+        std::vector<Value *> lanes;
+        for (auto packIter = pack->begin(); packIter != pack->end();
+             packIter++) {
+          lanes.push_back((*packIter)->getOperand(operandNum));
+        }
+        auto cached = operandVecs.find(lanes);
+        if (cached != operandVecs.end() &&
+            availableAt(cached->second, &*builder.GetInsertPoint())) {
+          if (verbose)
+            logs() << "[codeGen] reuse " << *cached->second << "\n";
+          return cached->second;
+        }
 
         // determine element type in vector
         Type *baseType;
@@ -468,13 +3259,32 @@ public:
         }
 
         // create new vec
-        auto *vecType = VectorType::get(baseType, pack->getSize());
+        auto *vecType = FixedVectorType::get(baseType, pack->getSize());
         auto *zero = builder.getInt32(0);
         auto *size = builder.getInt32(1);
         auto *initVec = UndefValue::get(vecType);
 
         Value *currVec = initVec;
 
+        // if every lane uses the same value, broadcast it
+        Value *splat = pack->getFirstElement()->getOperand(operandNum);
+        for (auto packIter = pack->begin(); packIter != pack->end();
+             packIter++) {
+          if ((*packIter)->getOperand(operandNum) != splat) {
+            splat = nullptr;
+            break;
+          }
+        }
+        if (splat) {
+          auto splatDef = dyn_cast<Instruction>(splat);
+          if (!splatDef || P.findPack(splatDef) == nullptr) {
+            currVec = builder.CreateVectorSplat(pack->getSize(), splat);
+            logs() << "\t" << *currVec << "\n";
+            operandVecs[lanes] = currVec;
+            return currVec;
+          }
+        }
+
         for (int i = 0; i < pack->getSize(); i++) {
           Instruction *instr = pack->getNthElement(i);
           Value *operand = instr->getOperand(operandNum);
@@ -488,7 +3298,7 @@ public:
             // currVec
             if (operandPack == nullptr) {
               currVec = builder.CreateInsertElement(currVec, def, i);
-              outs() << "\t" << *currVec << "\n";
+              logs() << "\t" << *currVec << "\n";
             }
             // operand is in a pack, so need to extract it and insert it
             else {
@@ -496,37 +3306,51 @@ public:
               int index = operandPack->getIndex(def);
               auto *newDef =
                   builder.CreateExtractElement(operandPack->getValue(), index);
-              outs() << "\t" << *newDef << "\n";
+              logs() << "\t" << *newDef << "\n";
               currVec = builder.CreateInsertElement(currVec, newDef, i);
-              outs() << "\t" << *currVec << "\n";
+              logs() << "\t" << *currVec << "\n";
             }
           }
 
           // operand was not instruction, so just insert it
           else {
             currVec = builder.CreateInsertElement(currVec, operand, i);
-            outs() << "\t" << *currVec << "\n";
+            logs() << "\t" << *currVec << "\n";
           }
         }
 
         // return new vec
+        operandVecs[lanes] = currVec;
         return currVec;
       }
     };
 
-    outs() << "Code generation\n";
+    logs() << "Code generation\n";
 
     std::map<Pack *, bool> shouldDelete;
 
+    // Memory packs that are not accessed as one contiguous vector
+    std::vector<std::unique_ptr<StridedGroup>> groups;
+    std::map<Pack *, StridedGroup *> groupOf;
+    std::set<Pack *> gatherPacks, scalarPacks;
+    findInterleaveGroups(P, groups, groupOf, gatherPacks, scalarPacks);
+
+    // The block does nothing but copy or fill memory
+    bool copyOrFill = isCopyOrFillBlock(P);
+
+    // Packs of phis, whose carried vectors are generated after them
+    std::vector<Pack *> phiPacks;
+
     // iterate over all packs in the scheduledPackList
     for (auto packListIter = P.lbegin(); packListIter != P.lend();
          packListIter++) {
       Pack *pack = *packListIter;
       shouldDelete[pack] = true;
 
-      // only do codegen if pack is not independent stores
+      // only do codegen if pack is not independent stores, unless they fill
+      // memory with a splat or constant vector
       if (dyn_cast<StoreInst>(pack->getFirstElement())) {
-        if (!P.hasDependency(pack)) {
+        if (!P.hasDependency(pack) && !isFill(P, pack)) {
           shouldDelete[pack] = false;
           continue;
         }
@@ -541,44 +3365,113 @@ public:
       Type *type = pack->getType();
 
       // Vector types
-      auto vecType = VectorType::get(type, vecWidth);
+      auto vecType = FixedVectorType::get(type, vecWidth);
       auto vecPtrType = PointerType::get(vecType, 0);
 
       switch (opcode) {
 
       case Instruction::Load: {
+        // Lanes are not evenly spaced: keep the scalar loads and insert them
+        if (gatherPacks.find(pack) != gatherPacks.end()) {
+          Value *vec = UndefValue::get(vecType);
+          for (unsigned int i = 0; i < vecWidth; i++) {
+            vec = builder.CreateInsertElement(vec, pack->getNthElement(i), i);
+          }
+          pack->setDest(vec);
+          shouldDelete[pack] = false;
+          logs() << "\t" << *vec << "\n";
+          break;
+        }
+
+        // Interleaved lanes
+        unsigned int stride = getStride(pack);
+        if (stride > 1) {
+          auto field = loadInterleaved(builder, pack, stride, groupOf[pack]);
+          pack->setDest(field);
+          logs() << "\t" << *field << "\n";
+          break;
+        }
+
+        // The same addresses were already loaded and not written since
+        std::vector<Value *> addresses;
+        for (auto s : *pack) {
+          addresses.push_back(cast<LoadInst>(s)->getPointerOperand());
+        }
+        auto cached = vectorLoads.find(addresses);
+        if (cached != vectorLoads.end() &&
+            cached->second->getType() == vecType &&
+            loadAvailableAt(cached->second, pack->getLastElement())) {
+          pack->setDest(cached->second);
+          if (verbose)
+            logs() << "[codeGen] reuse " << *cached->second << "\n";
+          break;
+        }
+
         // Load pointer
-        auto align = getAlignment(pack->getFirstElement());
-        auto iv = align->inductionVar;
         auto firstLoad = dyn_cast<LoadInst>(pack->getFirstElement());
         auto basePtr = firstLoad->getPointerOperand();
         auto vecPtr = builder.CreateBitCast(basePtr, vecPtrType);
 
-        outs() << "\t" << *vecPtr << "\n";
+        logs() << "\t" << *vecPtr << "\n";
 
         // Load instruction
-        auto load = builder.CreateLoad(vecType, vecPtr);
+        auto load = builder.CreateAlignedLoad(
+            vecType, vecPtr, getVectorAlignment(firstLoad));
         pack->setDest(load);
+        vectorLoads[addresses] = load;
 
-        outs() << "\t" << *load << "\n";
+        logs() << "\t" << *load << "\n";
         break;
       }
 
       case Instruction::Store: {
+        // Keep the scalar stores, their values are extracted from the packs.
+        // Like a vector store they all happen at the last lane, after the
+        // vectors they store are computed
+        if (scalarPacks.find(pack) != scalarPacks.end()) {
+          for (size_t i = 0; i < pack->getSize(); i++) {
+            if (pack->getNthElement(i) != pack->getLastElement()) {
+              pack->getNthElement(i)->moveBefore(pack->getLastElement());
+            }
+          }
+          shouldDelete[pack] = false;
+          break;
+        }
+
+        // Interleaved lanes, stored at once when every field is ready
+        unsigned int stride = getStride(pack);
+        if (stride > 1) {
+          StridedGroup *group = groupOf[pack];
+          group->values[group->getField(pack)] =
+              getOperandVec(builder, P, pack, 0);
+          if (std::find(group->values.begin(), group->values.end(),
+                        nullptr) == group->values.end()) {
+            storeInterleaved(group);
+          }
+          break;
+        }
+
+        // Bulk copy or fill, see createMemTransfer()
+        if (copyOrFill && gatherPacks.empty() && scalarPacks.empty()) {
+          if (auto memOp = createMemTransfer(builder, P, pack)) {
+            logs() << "\t" << *memOp << "\n";
+            break;
+          }
+        }
+
         // Store pointer
-        auto align = getAlignment(pack->getFirstElement());
-        auto iv = align->inductionVar;
         auto firstStore = dyn_cast<StoreInst>(pack->getFirstElement());
         auto basePtr = firstStore->getPointerOperand();
         auto vecPtr = builder.CreateBitCast(basePtr, vecPtrType);
 
-        outs() << "\t" << *vecPtr << "\n";
+        logs() << "\t" << *vecPtr << "\n";
 
         // Store instruction
         Value *operand0 = getOperandVec(builder, P, pack, 0);
-        auto store = builder.CreateStore(operand0, vecPtr);
+        auto store = builder.CreateAlignedStore(
+            operand0, vecPtr, getVectorAlignment(firstStore));
 
-        outs() << "\t" << *store << "\n";
+        logs() << "\t" << *store << "\n";
         break;
       }
 
@@ -593,19 +3486,56 @@ public:
 
           // Function arguments
           std::vector<Value *> values;
-          for (unsigned int i = 0; i < intrinsicInst->getNumArgOperands();
-               i++) {
+          for (unsigned int i = 0; i < intrinsicInst->arg_size(); i++) {
+            // e.g. the is_int_min_poison flag of llvm.abs, same in every lane
+            if (hasVectorInstrinsicScalarOpd(intrinsicInst->getIntrinsicID(),
+                                             i)) {
+              values.push_back(intrinsicInst->getArgOperand(i));
+              continue;
+            }
             values.push_back(getOperandVec(builder, P, pack, i));
           }
           auto valuesArrayRef = ArrayRef<Value *>(values);
 
           auto intrinsic = builder.CreateIntrinsic(
               intrinsicInst->getIntrinsicID(), typesArrayRef, valuesArrayRef);
+          propagateIRFlags(intrinsic, SmallVector<Value *, 8>(pack->begin(),
+                                                              pack->end()));
           pack->setDest(intrinsic);
-          outs() << "\t" << *intrinsic << "\n";
+          logs() << "\t" << *intrinsic << "\n";
         } else {
-          outs() << "Unsupported instruction call\n";
+          llvm_unreachable("unsupported packs are cut before scheduling");
+        }
+        break;
+      }
+
+      case Instruction::PHI: {
+        // The vector enters the loop built from the incoming lanes, once in
+        // each block before it, and comes back from the carried pack
+        auto first = cast<PHINode>(pack->getFirstElement());
+        BasicBlock *BB = first->getParent();
+        auto phi = builder.CreatePHI(vecType, first->getNumIncomingValues());
+        std::map<BasicBlock *, Value *> entryVecs;
+        for (unsigned int j = 0; j < first->getNumIncomingValues(); j++) {
+          BasicBlock *incoming = first->getIncomingBlock(j);
+          Value *&vec = entryVecs[incoming];
+          if (vec == nullptr) {
+            vec = UndefValue::get(vecType);
+            IRBuilder<> entryBuilder(incoming->getTerminator());
+            for (unsigned int i = 0; i < vecWidth && incoming != BB; i++) {
+              auto lane = cast<PHINode>(pack->getNthElement(i));
+              vec = entryBuilder.CreateInsertElement(
+                  vec, lane->getIncomingValueForBlock(incoming), i);
+            }
+          }
+          phi->addIncoming(vec, incoming);
         }
+        pack->setDest(phi);
+        phiPacks.push_back(pack);
+        logs() << "\t" << *phi << "\n";
+
+        // lanes used outside the packs are extracted after the phis
+        builder.SetInsertPoint(BB, BB->getFirstInsertionPt());
         break;
       }
 
@@ -615,15 +3545,42 @@ public:
           Value *operand1 = getOperandVec(builder, P, pack, 1);
           auto binOp =
               builder.CreateBinOp(pack->getBinOp(), operand0, operand1);
+          // flags that hold in every lane, fast-math ones included
+          propagateIRFlags(binOp, SmallVector<Value *, 8>(pack->begin(),
+                                                          pack->end()));
           pack->setDest(binOp);
 
-          outs() << "\t" << *binOp << "\n";
+          logs() << "\t" << *binOp << "\n";
           break;
         } else {
-          outs() << "Unsupported opcode " << opcode << " ("
-                 << pack->getFirstElement()->getOpcodeName() << ")\n";
+          llvm_unreachable("unsupported packs are cut before scheduling");
+        }
+      }
+      }
+
+      // A horizontal reduction of the lanes replaces their scalar tree
+      std::vector<Instruction *> nodes;
+      if (Instruction *root = findReduction(P, *pack, nodes)) {
+        IRBuilder<> reduceBuilder(root);
+        Value *reduction =
+            createReduction(reduceBuilder, root, pack->getValue());
+        propagateIRFlags(reduction,
+                         SmallVector<Value *, 8>(nodes.begin(), nodes.end()));
+        logs() << "\t" << *reduction << "\n";
+        reduction->takeName(root);
+        root->replaceAllUsesWith(reduction);
+        for (auto node : nodes) {
+          node->dropAllReferences();
         }
+        for (auto node : nodes) {
+          erase(node);
+        }
+        NumReductions++;
       }
+
+      // The scalar lanes are kept, so their users need no extraction
+      if (!shouldDelete[pack]) {
+        continue;
       }
 
       /*
@@ -631,42 +3588,540 @@ public:
       of one of the instructions in this pack. in this case, extract the item
       out of the pack and replace it as the operand of the depdent instruction
       */
+      std::map<BasicBlock *, PHINode *> liveOutVecs;
       for (int i = 0; i < pack->getSize(); i++) {
         Instruction *def = pack->getNthElement(i);
+        std::set<Instruction *> outside, liveOut;
         for (auto *user : def->users()) {
           Instruction *userInstr = cast<Instruction>(user);
-          // if userInstr not in pack
-          if (P.findPack(userInstr) == nullptr) {
-            int index = pack->getIndex(def);
-            auto *newDef =
-                builder.CreateExtractElement(pack->getValue(), index);
-            // replace def with newDef
-            def->replaceAllUsesWith(newDef);
+          // if userInstr not in pack, or in a pack that stays scalar
+          Pack *userPack = P.findPack(userInstr);
+          if (isExtractedAfter(userInstr, def->getParent())) {
+            liveOut.insert(userInstr);
+          } else if (userPack == nullptr ||
+                     scalarPacks.find(userPack) != scalarPacks.end()) {
+            outside.insert(userInstr);
+          }
+        }
+
+        // the vector itself leaves the block, see isExtractedAfter()
+        int index = pack->getIndex(def);
+        for (auto userInstr : liveOut) {
+          auto userPhi = cast<PHINode>(userInstr);
+          BasicBlock *exit = userPhi->getParent();
+          PHINode *&vecPhi = liveOutVecs[exit];
+          if (vecPhi == nullptr) {
+            vecPhi = PHINode::Create(pack->getValue()->getType(), 1, "",
+                                     &exit->front());
+            vecPhi->addIncoming(pack->getValue(), userPhi->getIncomingBlock(0));
+            logs() << "\t" << *vecPhi << "\n";
+          }
+          IRBuilder<> exitBuilder(exit, exit->getFirstInsertionPt());
+          auto lane = exitBuilder.CreateExtractElement(vecPhi, index);
+          logs() << "\t" << *lane << "\n";
+          lane->takeName(userPhi);
+          userPhi->replaceAllUsesWith(lane);
+          erase(userPhi);
+        }
+        if (outside.empty()) {
+          continue;
+        }
+
+        auto *newDef = builder.CreateExtractElement(pack->getValue(), index);
+        auto extract = dyn_cast<Instruction>(newDef);
+        for (auto userInstr : outside) {
+          // replace def with newDef
+          userInstr->replaceUsesOfWith(def, newDef);
+          // a scalar statement between the lanes, see canSinkScalarUsers()
+          if (extract && !isa<PHINode>(userInstr) &&
+              userInstr->getParent() == extract->getParent() &&
+              userInstr->comesBefore(extract)) {
+            sinkAfter(userInstr, extract, P);
           }
         }
       }
     }
 
-    // Delete all the instructions in all packs
+    // Close the loops of the vector phis, see isCarried()
+    for (auto pack : phiPacks) {
+      auto phi = cast<PHINode>(pack->getValue());
+      auto first = cast<PHINode>(pack->getFirstElement());
+      BasicBlock *BB = first->getParent();
+      auto carried = cast<Instruction>(first->getIncomingValueForBlock(BB));
+      Value *vec = P.findPack(carried)->getValue();
+      for (unsigned int j = 0; j < phi->getNumIncomingValues(); j++) {
+        if (phi->getIncomingBlock(j) == BB) {
+          phi->setIncomingValue(j, vec);
+        }
+      }
+    }
+
+    // Delete all the instructions in all packs. Lanes still use the lanes of
+    // earlier packs, so every reference is dropped before anything is erased
+    for (auto packListIter = P.lbegin(); packListIter != P.lend();
+         packListIter++) {
+      Pack *pack = *packListIter;
+      if (shouldDelete[pack]) {
+        for (size_t i = 0; i < pack->getSize(); i++) {
+          pack->getNthElement(i)->dropAllReferences();
+        }
+      }
+    }
     for (auto packListIter = P.lbegin(); packListIter != P.lend();
          packListIter++) {
       Pack *pack = *packListIter;
       if (shouldDelete[pack]) {
         for (int i = 0; i < pack->getSize(); i++) {
-          pack->getNthElement(i)->eraseFromParent();
+          erase(pack->getNthElement(i));
+        }
+      }
+    }
+  }
+
+private:
+  Function &F;
+  const DataLayout &DL;
+  TargetLibraryInfo *TLI;
+  TargetTransformInfo *TTI;
+  ScalarEvolution *SE;
+  AAResults *AA;
+  DominatorTree *DT;
+  LoopInfo *LI;
+  BlockFrequencyInfo *BFI;
+  ProfileSummaryInfo *PSI;
+  OptimizationRemarkEmitter *ORE;
+
+  // Whether the block being extracted is cold: it is selected greedily,
+  // without the strided search, and vectorized in a single round
+  bool coldBlock = false;
+
+  // Cold blocks that have a plan, see analyze()
+  std::set<BasicBlock *> coldBlocks;
+
+  // Remarks waiting for commit(), see remark()
+  std::vector<std::unique_ptr<DiagnosticInfoOptimizationBase>> remarks;
+
+  // Pairs that the packs lead to but cannot be packed, with the reason code
+  std::vector<std::tuple<Instruction *, Instruction *, const char *>>
+      rejectedPairs;
+
+  // Pairs already explained by a CannotPack remark
+  std::set<std::pair<Instruction *, Instruction *>> remarkedPairs;
+
+  // Whether some block was split to add runtime alias checks
+  bool versioned = false;
+
+  std::set<Value *> baseAddress;
+  std::map<Instruction *, AlignInfo> alignInfo;
+
+  // Cached results of isIndependent, valid across rounds
+  std::map<std::pair<Instruction *, Instruction *>, bool> independence;
+
+  // Instructions erased since the last call to forgetErased()
+  std::set<Instruction *> erased;
+
+  // Scheduled packs of every basic block that will be vectorized
+  std::vector<std::pair<BasicBlock *, std::unique_ptr<PackSet>>> plans;
+
+  // Output of the analysis phase, see bufferLog()
+  std::string logBuffer;
+  raw_string_ostream log;
+};
+
+/*
+ * Raise the alignment of the internal globals that the vector accesses of M
+ * read or write to the preferred alignment of the vector type, since no code
+ * outside M depends on their placement, and let the accesses claim the
+ * alignment now known for their addresses. Globals belong to the module, so
+ * a function pass must not change them: this runs once the vector code of
+ * every function is generated, at the end of slp-parallel, as
+ * slp-align-globals after slp, in either pass manager.
+ */
+static bool alignGlobals(Module &M) {
+  const DataLayout &DL = M.getDataLayout();
+  std::vector<Instruction *> accesses;
+  for (auto &F : M) {
+    for (auto &BB : F) {
+      for (auto &s : BB) {
+        Type *type = nullptr;
+        if (isa<LoadInst>(&s)) {
+          type = s.getType();
+        } else if (auto store = dyn_cast<StoreInst>(&s)) {
+          type = store->getValueOperand()->getType();
+        }
+        if (type == nullptr || !type->isVectorTy()) {
+          continue;
+        }
+        accesses.push_back(&s);
+
+        Align prefAlign = DL.getPrefTypeAlign(type);
+        auto global = dyn_cast<GlobalVariable>(
+            getUnderlyingObject(getLoadStorePointerOperand(&s)));
+        if (global && global->hasLocalLinkage() &&
+            global->canIncreaseAlignment() &&
+            (!global->getAlign() || *global->getAlign() < prefAlign)) {
+          if (verbose)
+            logs() << "[alignGlobals] align " << global->getName() << " to "
+                   << prefAlign.value() << "\n";
+          global->setAlignment(prefAlign);
+          NumAlignedGlobals++;
         }
       }
     }
   }
 
+  bool changed = false;
+  for (auto s : accesses) {
+    Align known = getKnownAlignment(getLoadStorePointerOperand(s), DL);
+    if (auto load = dyn_cast<LoadInst>(s)) {
+      if (known > load->getAlign()) {
+        load->setAlignment(known);
+        changed = true;
+      }
+    } else if (known > cast<StoreInst>(s)->getAlign()) {
+      cast<StoreInst>(s)->setAlignment(known);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/*
+ * Legacy pass manager: opt -load slp.so -slp
+ */
+class LegacySLP : public FunctionPass {
+public:
+  static char ID;
+  LegacySLP() : FunctionPass(ID) {}
+  ~LegacySLP() {}
+
+  // Blocks may be split by runtime alias checks, but the dominator tree and
+  // loop info are kept up to date
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<AAResultsWrapperPass>();
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+    AU.addRequired<ProfileSummaryInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+    AU.addRequired<TargetLibraryInfoWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+    AU.addPreserved<DominatorTreeWrapperPass>();
+    AU.addPreserved<LoopInfoWrapperPass>();
+  }
+
+  bool doInitialization(Module &M) override {
+    return false;
+  }
+
+  bool runOnFunction(Function &F) override {
+    auto &TLI = getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
+    auto &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    auto &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+    auto &AA = getAnalysis<AAResultsWrapperPass>().getAAResults();
+    auto &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    auto &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    auto &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+    auto &PSI = getAnalysis<ProfileSummaryInfoWrapperPass>().getPSI();
+    auto &ORE = getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+    return SLP(F, &TLI, &TTI, &SE, &AA, &DT, &LI, &BFI, &PSI, &ORE)
+        .runOnFunction();
+  }
+
   bool doFinalization(Module &M) override {
     return false;
   }
+};
 
-private:
-  std::set<Value *> baseAddress;
-  std::map<Instruction *, AlignInfo> alignInfo;
+char LegacySLP::ID = 0;
+static RegisterPass<LegacySLP> X("slp", "Superword level parallelism", false,
+                                 false);
+
+/*
+ * Legacy pass manager, after slp: opt -load slp.so -slp -slp-align-globals
+ */
+class LegacySLPAlignGlobals : public ModulePass {
+public:
+  static char ID;
+  LegacySLPAlignGlobals() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override {
+    return alignGlobals(M);
+  }
 };
 
-char SLP::ID = 0;
-static RegisterPass<SLP> X("slp", "Superword level parallelism", false, false);
+char LegacySLPAlignGlobals::ID = 0;
+static RegisterPass<LegacySLPAlignGlobals>
+    AlignGlobals("slp-align-globals",
+                 "Align internal globals to the vector accesses of the SLP "
+                 "pass",
+                 false, false);
+
+/*
+ * New pass manager: opt -load-pass-plugin slp.so -passes=slp
+ */
+PreservedAnalyses SLPPass::run(Function &F, FunctionAnalysisManager &FAM) {
+  auto &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+  auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  auto &AA = FAM.getResult<AAManager>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+  auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+  // Only available when an earlier module pass computed it
+  auto *PSI = FAM.getResult<ModuleAnalysisManagerFunctionProxy>(F)
+                  .getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+  SLP slp(F, &TLI, &TTI, &SE, &AA, &DT, &LI, &BFI, PSI, &ORE);
+  if (!slp.runOnFunction()) {
+    return PreservedAnalyses::all();
+  }
+  return slp.getPreservedAnalyses();
+}
+
+/*
+ * New pass manager, whole module: opt -load-pass-plugin slp.so
+ * -passes=slp-parallel
+ *
+ * Functions are analyzed concurrently on a thread pool. The analyses they
+ * need are computed up front on this thread, since the analysis manager is
+ * not thread-safe, and the resulting plans are committed one function at a
+ * time once every analysis has finished.
+ */
+PreservedAnalyses SLPModulePass::run(Module &M, ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  auto &PSI = MAM.getResult<ProfileSummaryAnalysis>(M);
+
+  std::vector<std::unique_ptr<SLP>> contexts;
+  for (auto &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    auto &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+    auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+    auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+    auto &AA = FAM.getResult<AAManager>(F);
+    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    auto &LI = FAM.getResult<LoopAnalysis>(F);
+    auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+    auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+    contexts.push_back(std::make_unique<SLP>(F, &TLI, &TTI, &SE, &AA, &DT, &LI,
+                                             &BFI, &PSI, &ORE));
+  }
+
+  // Idioms are rewritten in the IR, so one function at a time
+  std::vector<bool> prepared;
+  for (auto &context : contexts) {
+    context->bufferLog();
+    prepared.push_back(context->prepare());
+    setLogStream(nullptr);
+  }
+
+  ThreadPool pool(hardware_concurrency(SLPThreads));
+  for (auto &context : contexts) {
+    SLP *slp = context.get();
+    pool.async([slp]() {
+      slp->bufferLog();
+      slp->analyze();
+      setLogStream(nullptr);
+    });
+  }
+  pool.wait();
+
+  // Functions are independent, so each one reports what it preserves
+  bool changed = false;
+  for (unsigned int i = 0; i < contexts.size(); i++) {
+    auto &context = contexts[i];
+    if (context->commit() || prepared[i]) {
+      FAM.invalidate(context->getFunction(), context->getPreservedAnalyses());
+      changed = true;
+    }
+  }
+  changed |= alignGlobals(M);
+
+  if (!changed) {
+    return PreservedAnalyses::all();
+  }
+  PreservedAnalyses PA;
+  PA.preserve<FunctionAnalysisManagerModuleProxy>();
+  return PA;
+}
+
+/*
+ * New pass manager, after slp: opt -load-pass-plugin slp.so
+ * -passes='function(slp),slp-align-globals'
+ */
+PreservedAnalyses SLPAlignGlobalsPass::run(Module &M,
+                                           ModuleAnalysisManager &MAM) {
+  if (!alignGlobals(M)) {
+    return PreservedAnalyses::all();
+  }
+  // Only alignments change, the CFG and the values stay
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+
+/*
+ * Whether the address ptr advances by exactly size bytes per iteration of L,
+ * which encloses the loops of the other recurrences of ptr
+ */
+static bool isContiguousAlong(const SCEV *ptr, Loop *L, uint64_t size,
+                              ScalarEvolution &SE) {
+  while (auto addRec = dyn_cast<SCEVAddRecExpr>(ptr)) {
+    if (addRec->getLoop() == L) {
+      auto step = dyn_cast<SCEVConstant>(addRec->getStepRecurrence(SE));
+      return step && step->getAPInt() == size;
+    }
+    ptr = addRec->getStart();
+  }
+  return false;
+}
+
+/*
+ * The number of outer iterations to jam into the inner loop of the nest L:
+ * as many elements of the widest access contiguous along L as fit in a
+ * vector register, or 0 when the inner loop has no such access
+ */
+static unsigned int getUnrollAndJamCount(Loop *L, ScalarEvolution &SE) {
+  const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
+  uint64_t widest = 0;
+  for (auto BB : L->getSubLoops()[0]->blocks()) {
+    for (auto &s : *BB) {
+      Value *ptr = getLoadStorePointerOperand(&s);
+      if (ptr == nullptr) {
+        continue;
+      }
+      uint64_t size =
+          DL.getTypeStoreSize(ptr->getType()->getPointerElementType());
+      if (isContiguousAlong(SE.getSCEV(ptr), L, size, SE)) {
+        widest = std::max(widest, size);
+      }
+    }
+  }
+  if (widest == 0) {
+    return 0;
+  }
+  if (SLPUnrollAndJamCount > 0) {
+    return SLPUnrollAndJamCount;
+  }
+  return std::max<uint64_t>(SLPVectorBits / 8 / widest, 1);
+}
+
+/*
+ * New pass manager: opt -load-pass-plugin slp.so -passes=slp-unroll-and-jam
+ *
+ * In a nest like for j { for k { C[i][j] += A[i][k] * B[k][j]; } } the
+ * accesses to consecutive elements, B[k][j] and B[k][j + 1], belong to
+ * different iterations of the outer loop, where a basic block pass cannot
+ * see them together. Unrolling the outer loop by the vector width and
+ * jamming the copies into the inner body makes them adjacent statements of
+ * one block, which findAdjRefs pairs. Nests whose dependences forbid the
+ * reordering are left alone.
+ *
+ * Nests whose inner loops come in sequence, like the loop that fills tmp[k]
+ * and the one that sums it in mmm, are left to LLVM's loop-fusion, indvars,
+ * gvn and instcombine ahead of this pass, see tests/Makefile. The loads that
+ * the copies repeat, like A[i][k], are left to gvn after it.
+ */
+PreservedAnalyses SLPUnrollAndJamPass::run(Function &F,
+                                           FunctionAnalysisManager &FAM) {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &DI = FAM.getResult<DependenceAnalysis>(F);
+  auto &AC = FAM.getResult<AssumptionAnalysis>(F);
+  auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+  auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+  // The outer loops of the two-level nests, before unrolling changes LI
+  SmallVector<Loop *, 4> nests;
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (L->getSubLoops().size() == 1 &&
+        L->getSubLoops()[0]->getSubLoops().empty()) {
+      nests.push_back(L);
+    }
+  }
+
+  bool changed = false;
+  for (Loop *L : nests) {
+    unsigned int count = getUnrollAndJamCount(L, SE);
+    unsigned int tripCount = SE.getSmallConstantTripCount(L);
+    if (count < 2 || (tripCount > 0 && tripCount < count)) {
+      continue;
+    }
+
+    changed |= simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr, false);
+    changed |= formLCSSARecursively(*L, DT, &LI, &SE);
+    if (!isSafeToUnrollAndJam(L, SE, DT, DI, LI)) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "UnrollAndJamUnsafe",
+                                        L->getStartLoc(), L->getHeader())
+               << "not unrolled and jammed: the inner loop cannot be "
+                  "interleaved across iterations of this loop";
+      });
+      continue;
+    }
+
+    auto result = UnrollAndJamLoop(L, count, tripCount,
+                                   SE.getSmallConstantTripMultiple(L), false,
+                                   &LI, &SE, &DT, &AC, &TTI, &ORE);
+    if (result == LoopUnrollResult::Unmodified) {
+      continue;
+    }
+
+    // Every copy keeps its own inner induction variable, which hides that
+    // the copies index the same elements along the inner loop
+    SCEVExpander expander(SE, F.getParent()->getDataLayout(), "slp");
+    SmallVector<WeakTrackingVH, 4> dead;
+    expander.replaceCongruentIVs(L->getSubLoops()[0], &DT, dead, &TTI);
+    RecursivelyDeleteTriviallyDeadInstructionsPermissive(dead);
+
+    // The copies fill a vector already. Unrolling the inner loop as well
+    // would make its accesses adjacent along the inner dimension too, and
+    // those pairs would compete for the same statements
+    addStringMetadataToLoop(L->getSubLoops()[0], "llvm.loop.unroll.disable",
+                            1);
+    logs() << "[unrollAndJam] " << F.getName() << ": jammed " << count
+           << " iterations of " << L->getHeader()->getName() << "\n";
+    changed = true;
+  }
+
+  if (!changed) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "SLP", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "slp") {
+                    FPM.addPass(SLPPass());
+                    return true;
+                  }
+                  if (Name == "slp-unroll-and-jam") {
+                    FPM.addPass(SLPUnrollAndJamPass());
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "slp-parallel") {
+                    MPM.addPass(SLPModulePass());
+                    return true;
+                  }
+                  if (Name == "slp-align-globals") {
+                    MPM.addPass(SLPAlignGlobalsPass());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
@@ -1,15 +1,55 @@
 #ifndef __SLP_SLP_HPP__
 #define __SLP_SLP_HPP__
 
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/iterator.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
-
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/UnrollLoop.h"
+
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <set>
+#include <tuple>
 
 #include "utils.hpp"
 
@@ -22,6 +62,9 @@ class PackSet;
 /*
  * A Pack is an n-tuple, <s1, ..., sn>, where s1, ..., sn are independent
  * isomorphic statements in a basic block
+ *
+ * Packs are allocated in the arena of their PackSet and keep up to four lanes
+ * inline, so a Pack * stays valid for as long as its PackSet exists.
  */
 class Pack {
 public:
@@ -32,18 +75,14 @@ public:
     pack.push_back(s2);
   }
 
-  // Only used to combine two packs
-  Pack(std::vector<Instruction *> v1, std::vector<Instruction *> v2)
-      : value(nullptr) {
-    pack.reserve(v1.size() + v2.size() - 1);
-    pack.insert(pack.end(), v1.begin(), v1.end());
-    pack.insert(pack.end(), ++(v2.begin()), v2.end());
-  }
+  // Only used to combine a chain of pairs
+  Pack(ArrayRef<Instruction *> chain)
+      : pack(chain.begin(), chain.end()), value(nullptr) {}
 
   void print(unsigned int index) const {
-    outs() << "\tPack " << index << " (" << this << ")\n";
+    logs() << "\tPack " << index << " (" << this << ")\n";
     for (unsigned int i = 0; i < pack.size(); i++) {
-      outs() << "\t\t" << i << ": " << *(pack[i]) << "\n";
+      logs() << "\t\t" << i << ": " << *(pack[i]) << "\n";
     }
   }
 
@@ -122,7 +161,7 @@ public:
   }
 
   // Pack iterator
-  typedef std::vector<Instruction *>::iterator PackIterator;
+  typedef SmallVectorImpl<Instruction *>::iterator PackIterator;
 
   PackIterator begin() {
     return pack.begin();
@@ -170,7 +209,7 @@ public:
   }
 
 private:
-  std::vector<Instruction *> pack;
+  SmallVector<Instruction *, 4> pack;
 
   // Destination value
   Value *value;
@@ -184,43 +223,50 @@ public:
   PackSet() {}
 
   Pack &getNthPack(unsigned int n) {
-    return packSet[n];
+    return *packSet[n];
   }
 
   void printPackSet() {
     if (packSet.size() == 0)
       return;
 
-    outs() << "PackSet\n";
+    logs() << "PackSet\n";
     unsigned int index = 0;
-    for (auto &p : packSet) {
+    for (auto &p : *this) {
       p.print(index);
       index++;
     }
-    outs() << "\n";
+    logs() << "\n";
   }
 
   void printScheduledPackList() {
     if (scheduledPackList.size() == 0)
       return;
 
-    outs() << "Scheduled Pack List\n";
+    logs() << "Scheduled Pack List\n";
     unsigned int index = 0;
     for (unsigned int i = 0; i < scheduledPackList.size(); i++) {
       scheduledPackList[i]->print(i);
     }
-    outs() << "\n";
+    logs() << "\n";
   }
 
   void addPair(Instruction *s1, Instruction *s2) {
     add(Pack(s1, s2));
     if (verbose)
-      outs() << "[addPair] (" << *s1 << ") and (" << *s2 << ")\n";
+      logs() << "[addPair] (" << *s1 << ") and (" << *s2 << ")\n";
+  }
+
+  // Add a chain of combined pairs, only used in the combination process and
+  // for cached plans. Chains are disjoint, so no need to check for an
+  // existing pack.
+  void addChain(ArrayRef<Instruction *> chain) {
+    packSet.push_back(new (arena.Allocate()) Pack(chain));
   }
 
-  // Combine pack p1 and p2, only used in the combination process
-  void addCombination(Pack &p1, Pack &p2) {
-    add(Pack(p1.pack, p2.pack));
+  // Remove all packs, their handles stay valid
+  void clear() {
+    packSet.clear();
   }
 
   void remove(Pack &p) {
@@ -228,7 +274,7 @@ public:
   }
 
   bool pairExists(Instruction *s1, Instruction *s2) {
-    for (auto &t : packSet) {
+    for (auto &t : *this) {
       if (t.isPair()) {
         if (t.getLeftElement() == s1 && t.getRightElement() == s2) {
           return true;
@@ -238,15 +284,15 @@ public:
     return false;
   }
 
-  // PackSet iterator
-  typedef std::vector<Pack>::iterator PackSetIterator;
+  // PackSet iterator, which dereferences the pack handles
+  typedef pointee_iterator<std::vector<Pack *>::iterator> PackSetIterator;
 
   PackSetIterator begin() {
-    return packSet.begin();
+    return PackSetIterator(packSet.begin());
   }
 
   PackSetIterator end() {
-    return packSet.end();
+    return PackSetIterator(packSet.end());
   }
 
   // Scheduled PackList iterator
@@ -260,20 +306,17 @@ public:
     return scheduledPackList.end();
   }
 
-  bool schedule() {
+  /*
+   * lonePack: whether a single pack is worth vectorizing by itself, like a
+   * store pack that fills memory or a pack that is reduced
+   */
+  bool schedule(bool lonePack = false) {
     // No need to perform SLP for only one pack
-    if (packSet.size() <= 1) {
+    if (packSet.size() < (lonePack ? 1u : 2u)) {
+      scheduleFailure = "TooFewPacks";
       return false;
     }
 
-    // Ensure every pack has the same size
-    size_t packSetSize = packSet.begin()->getSize();
-    for (auto &pack : packSet) {
-      if (pack.getSize() != packSetSize) {
-        return false;
-      }
-    }
-
     buildDependency();
 
     // Already scheduled packs
@@ -282,8 +325,7 @@ public:
     unsigned int scheduledOldSize;
     do {
       scheduledOldSize = scheduled.size();
-      for (auto &pRef : packSet) {
-        Pack *p = &pRef;
+      for (auto p : packSet) {
 
         // Don't look at already scheduled packs
         if (scheduled.find(p) != scheduled.end()) {
@@ -313,7 +355,31 @@ public:
         }
       }
     } while (scheduledOldSize != scheduled.size());
-    return (scheduledPackList.size() == packSet.size()) && (packSet.size() > 0);
+    if (scheduledPackList.size() != packSet.size()) {
+      scheduleFailure = "DependenceCycle";
+      return false;
+    }
+    return true;
+  }
+
+  /*
+   * Take the packs, in the order they were added, as an earlier schedule of
+   * the same packs, where dependent[i] tells whether the i-th pack depended
+   * on another one. Used instead of schedule() for cached plans.
+   */
+  void restoreSchedule(const std::vector<bool> &dependent) {
+    assert(dependent.size() == packSet.size());
+    scheduledPackList = packSet;
+    for (unsigned int i = 0; i < packSet.size(); i++) {
+      if (dependent[i]) {
+        dependency[packSet[i]];
+      }
+    }
+  }
+
+  // Reason code of the last failed call to schedule()
+  const char *getScheduleFailure() const {
+    return scheduleFailure;
   }
 
   size_t size() {
@@ -322,10 +388,10 @@ public:
 
   // Find the pack of instruction s
   Pack *findPack(Instruction *s) {
-    for (auto &p : packSet) {
-      for (auto &i : p) {
+    for (auto p : packSet) {
+      for (auto i : *p) {
         if (s == i) {
-          return &p;
+          return p;
         }
       }
     }
@@ -333,9 +399,9 @@ public:
   }
 
   void findPrePack() {
-    unsigned int vecWidth = packSet[0].getVecWidth();
     for (auto &p : scheduledPackList) {
       auto instr = p->getFirstElement();
+      unsigned int vecWidth = p->getVecWidth();
 
       for (unsigned int i = 0; i < instr->getNumOperands(); i++) {
         bool add = false;
@@ -353,11 +419,11 @@ public:
             tmp.push_back(di);
           }
           if (verbose) {
-            outs() << "\tprepacking Pack (" << p << "):";
+            logs() << "\tprepacking Pack (" << p << "):";
             for (auto &v : tmp) {
-              outs() << " (" << v->getName() << ")";
+              logs() << " (" << v->getName() << ")";
             }
-            outs() << "\n";
+            logs() << "\n";
           }
           prePack.push_back(tmp);
         }
@@ -366,9 +432,9 @@ public:
   }
 
   void findPostPack() {
-    unsigned int vecWidth = packSet[0].getVecWidth();
     for (auto &p : scheduledPackList) {
       auto instr = p->getFirstElement();
+      unsigned int vecWidth = p->getVecWidth();
       bool add = false;
 
       if (!isa<BinaryOperator>(instr))
@@ -397,11 +463,11 @@ public:
           tmp.push_back((Value *)ii);
         }
         if (verbose) {
-          outs() << "\tpostpacking Pack (" << p << "):";
+          logs() << "\tpostpacking Pack (" << p << "):";
           for (auto &v : tmp) {
-            outs() << " (" << v->getName() << ")";
+            logs() << " (" << v->getName() << ")";
           }
-          outs() << "\n";
+          logs() << "\n";
         }
 
         postPack.push_back(tmp);
@@ -415,12 +481,15 @@ public:
 
 private:
   /*
-   * packSet, stored in a vector
+   * packSet, stored in a vector of handles to the packs in the arena
    *
    * The reason why we don't use std::set is that the default iterator is
    * always const, so instead we use std::vector to replace the set.
    */
-  std::vector<Pack> packSet;
+  std::vector<Pack *> packSet;
+
+  // Arena owning every pack created by this PackSet, removed ones included
+  SpecificBumpPtrAllocator<Pack> arena;
 
   /*
    * Dependency graph
@@ -434,27 +503,27 @@ private:
    */
   std::vector<Pack *> scheduledPackList;
 
+  const char *scheduleFailure = nullptr;
+
   std::vector<std::vector<Value *>> prePack;
 
   std::vector<std::vector<Value *>> postPack;
 
   // Add pack p to packSet (stored in a vector)
   void add(Pack &&p) {
-    for (auto &t : packSet) {
+    for (auto &t : *this) {
       if (t == p) {
         return;
       }
     }
-    packSet.emplace_back(p);
+    packSet.push_back(new (arena.Allocate()) Pack(std::move(p)));
   }
 
-  // Erase pack p from packSet (stored in a vector)
+  // Erase pack p from packSet (stored in a vector), its handle stays valid
   void erase(Pack &p) {
-    for (auto iter = packSet.begin(); iter != packSet.end(); iter++) {
-      if (p == *iter) {
-        packSet.erase(iter);
-      }
-    }
+    packSet.erase(std::remove_if(packSet.begin(), packSet.end(),
+                                 [&p](Pack *t) { return *t == p; }),
+                  packSet.end());
   }
 
   // Construct the dependency graph
@@ -492,11 +561,11 @@ private:
       Pack *p = it->first;
       std::set<Pack *> pDeps = it->second;
       if (verbose) {
-        outs() << "The pack " << p << " depends on packs:";
+        logs() << "The pack " << p << " depends on packs:";
         for (auto pDep : pDeps) {
-          outs() << " " << pDep;
+          logs() << " " << pDep;
         }
-        outs() << "\n";
+        logs() << "\n";
       }
     }
   }
@@ -504,15 +573,17 @@ private:
 
 /*
  * AlignInfo class stores the basic alignment information described in the
- * paper, including a base address, an induction variable, and the index (or
- * offset against the base address).
+ * paper: a base address, and the offset against the base address. The offset
+ * is split into its non-constant part, a ScalarEvolution expression, and the
+ * constant index in bytes. size is the number of bytes of one element.
  *
  * In the foo example,
  *  A[i + 0] = A[i + 0] * A[i + 0];
  *  A[i + 1] = A[i + 1] * A[i + 1];
  *  A[i + 2] = A[i + 2] * A[i + 2];
  *  A[i + 3] = A[i + 3] * A[i + 3]; <--
- * Look at the last instruction, base = A, inductionVar = i, index = 3
+ * Look at the last instruction, base = A, offset = (8 * i), index = 24,
+ * size = 8
  *
  * Alignment information will first be assigned to load and store instruction,
  * and in next steps the align info of memory access instructions will be copied
@@ -520,12 +591,130 @@ private:
  */
 class AlignInfo {
 public:
-  AlignInfo(Value *base, Value *inductionVar, unsigned int index)
-      : base(base), inductionVar(inductionVar), index(index) {}
+  AlignInfo(Value *base, const SCEV *offset, int64_t index, uint64_t size)
+      : base(base), offset(offset), index(index), size(size) {}
 
   Value *base;
-  Value *inductionVar;
-  unsigned int index;
+  const SCEV *offset;
+  int64_t index;
+  uint64_t size;
+};
+
+/*
+ * A StridedGroup is a set of strided memory packs of the same kind, one
+ * per field, whose lanes together cover stride * VF consecutive elements. In
+ * the example below (stride = 2, VF = 4)
+ *   <A[i + 0], A[i + 2], A[i + 4], A[i + 6]>   field 0
+ *   <A[i + 1], A[i + 3], A[i + 5], A[i + 7]>   field 1
+ * both packs are loaded (or stored) with a single wide memory access, and
+ * each field is split out of it (or merged into it) with a shufflevector.
+ */
+class StridedGroup {
+public:
+  StridedGroup(unsigned int stride)
+      : stride(stride), fields(stride, nullptr), values(stride, nullptr),
+        wide(nullptr) {}
+
+  unsigned int getField(Pack *p) const {
+    return std::find(fields.begin(), fields.end(), p) - fields.begin();
+  }
+
+  // Latest lane of all the fields in program order
+  Instruction *getLastLane() const {
+    Instruction *last = nullptr;
+    for (auto p : fields) {
+      for (auto s : *p) {
+        if (last == nullptr || last->comesBefore(s)) {
+          last = s;
+        }
+      }
+    }
+    return last;
+  }
+
+  unsigned int stride;
+
+  // fields[j] is the pack accessing the elements j, j + stride, ...
+  std::vector<Pack *> fields;
+
+  // Stores: the vector stored by each field, filled in during codegen
+  std::vector<Value *> values;
+
+  // Loads: the wide vector loaded for the whole group
+  Value *wide;
+};
+
+/*
+ * A LiveVector is a vector that codeGen keeps in a register, see
+ * SLP::estimatePressure. It is either the value of a pack, built at the last
+ * element of the pack and live until the last pack that uses it, or an
+ * operand vector built from scalars, live from the first pack that uses it
+ * to the last one. Positions count the statements of the block.
+ */
+class LiveVector {
+public:
+  LiveVector(Pack *pack, unsigned int def) : pack(pack), def(def) {}
+
+  // Live range [first, last), empty if nothing keeps the vector live
+  std::pair<unsigned int, unsigned int> getRange() const {
+    if (dropped || (pack == nullptr && uses.empty())) {
+      return std::make_pair(0u, 0u);
+    }
+    unsigned int first = def, last = def;
+    for (auto &use : uses) {
+      if (pack == nullptr) {
+        first = std::min(first, use.second);
+      }
+      last = std::max(last, use.second);
+    }
+    return std::make_pair(first, std::max(last, first + 1));
+  }
+
+  // The pack whose value this is, or nullptr for an operand vector
+  Pack *pack;
+
+  // Position of the last element of the pack, or of the first user of an
+  // operand vector
+  unsigned int def;
+
+  // Position of the last element of every pack that uses the vector
+  std::map<Pack *, unsigned int> uses;
+
+  // Whether the pack was dropped and its lanes stay scalar
+  bool dropped = false;
+};
+
+/*
+ * The SLP pass for the new pass manager, see slp.cpp
+ */
+class SLPPass : public PassInfoMixin<SLPPass> {
+public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+/*
+ * The SLP pass over a whole module, analyzing functions in parallel
+ */
+class SLPModulePass : public PassInfoMixin<SLPModulePass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+/*
+ * Alignment of the internal globals that vector code accesses, after the SLP
+ * pass, see slp.cpp
+ */
+class SLPAlignGlobalsPass : public PassInfoMixin<SLPAlignGlobalsPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+/*
+ * Unroll-and-jam of two-level loop nests ahead of the SLP pass, see slp.cpp
+ */
+class SLPUnrollAndJamPass : public PassInfoMixin<SLPUnrollAndJamPass> {
+public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
 };
 
-#endif // __SLP_UTILS_HPP__
+#endif // __SLP_SLP_HPP__
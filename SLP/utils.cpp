@@ -1,4 +1,5 @@
 #include "utils.hpp"
+#include "llvm/Analysis/VectorUtils.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/raw_ostream.h"
 
@@ -6,6 +7,9 @@ bool isIsomorphic(Instruction *s1, Instruction *s2) {
   bool bothBinaryOperator = isa<BinaryOperator>(s1) && isa<BinaryOperator>(s2);
   bool bothLoadInst = isa<LoadInst>(s1) && isa<LoadInst>(s2);
   bool bothStoreInst = isa<StoreInst>(s1) && isa<StoreInst>(s2);
+  // Phis merge the same blocks only when they are in the same block
+  bool bothPHINode = isa<PHINode>(s1) && isa<PHINode>(s2) &&
+                     s1->getParent() == s2->getParent();
   bool bothIntrinsicCallInst = false;
   auto c1 = dyn_cast<IntrinsicInst>(s1);
   auto c2 = dyn_cast<IntrinsicInst>(s2);
@@ -14,16 +18,27 @@ bool isIsomorphic(Instruction *s1, Instruction *s2) {
     auto i2 = c2->getIntrinsicID();
     if (i1 == i2) {
       bothIntrinsicCallInst = true;
+      // Operands that stay scalar in the vector form must be the same
+      for (unsigned int i = 0; i < c1->arg_size(); i++) {
+        if (hasVectorInstrinsicScalarOpd(i1, i) &&
+            c1->getArgOperand(i) != c2->getArgOperand(i)) {
+          bothIntrinsicCallInst = false;
+        }
+      }
     }
   }
 
   return (s1->getOpcode() == s2->getOpcode()) &&
          (s1->getType() == s2->getType()) &&
          (bothBinaryOperator || bothLoadInst || bothStoreInst ||
-          bothIntrinsicCallInst);
+          bothPHINode || bothIntrinsicCallInst);
 }
 
 bool isDependentOn(Instruction *s, Instruction *sDep) {
+  // A phi uses the values of the previous iteration
+  if (isa<PHINode>(s)) {
+    return false;
+  }
   for (auto *sDepUser : sDep->users()) {
     if ((Value *)sDepUser == (Value *)s) {
       return true;
@@ -35,3 +50,13 @@ bool isDependentOn(Instruction *s, Instruction *sDep) {
 bool isIndependent(Instruction *s1, Instruction *s2) {
   return (!isDependentOn(s1, s2)) && (!isDependentOn(s2, s1));
 }
+
+static thread_local raw_ostream *logStream = nullptr;
+
+raw_ostream &logs() {
+  return logStream ? *logStream : outs();
+}
+
+void setLogStream(raw_ostream *OS) {
+  logStream = OS;
+}
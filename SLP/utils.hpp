@@ -3,17 +3,26 @@
 
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
 
 using namespace llvm;
 
 // If two instructions have the same operation and type, and both are binary
-// operations, they are isomorphic
+// operations, loads, stores, phis of the same block or calls of the same
+// intrinsic with the same scalar operands, they are isomorphic
 bool isIsomorphic(Instruction *s1, Instruction *s2);
 
-// Check whether s depends on sDep (RAW data dependency)
+// Check whether s depends on sDep (RAW data dependency) in the same iteration
+// of its block
 bool isDependentOn(Instruction *s, Instruction *sDep);
 
 // If two instructions have no dependency, they are independent
 bool isIndependent(Instruction *s1, Instruction *s2);
 
+// Stream for the verbose output of the pass, outs() unless redirected
+raw_ostream &logs();
+
+// Redirect logs() on the calling thread, or restore it with nullptr
+void setLogStream(raw_ostream *OS);
+
 #endif // __SLP_UTILS_HPP__
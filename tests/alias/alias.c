@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <time.h>
+
+#define N 16
+#define ITERATIONS (1 << 20)
+
+static float A[N], B[N], C[N];
+
+void set() {
+  for (int i = 0; i < N; i++) {
+    A[i] = (float)i;
+    B[i] = (float)i;
+    C[i] = 0;
+  }
+}
+
+// Stores at negative offsets from p: when p = q + 4, p[-1] is q[3], which is
+// read after it is written, so the overlap check must cover p - 1
+void shift(float *p, float *q) {
+  p[-1] = q[0] * 2;
+  p[0] = q[1] * 2;
+  p[1] = q[2] * 2;
+  p[2] = q[3] * 2;
+}
+
+// Two runs of one array at offsets that differ by an unknown amount: when
+// j = i - 1, p[j + 1] is p[i], which is read after it is written, so the runs
+// must be checked for overlap even though they share their base
+void rows(float *p, long i, long j) {
+  p[i] = p[j] * 2;
+  p[i + 1] = p[j + 1] * 2;
+  p[i + 2] = p[j + 2] * 2;
+  p[i + 3] = p[j + 3] * 2;
+}
+
+int main() {
+  set();
+
+  clock_t start, end;
+  start = clock();
+  for (int i = 0; i < ITERATIONS; i++) {
+    shift(C + 4, B);
+  }
+  end = clock();
+  double t = ((double)(end - start)) / CLOCKS_PER_SEC * 1e6;
+
+  // overlapping ranges, run once
+  shift(A + 4, A);
+  rows(A, 9, 8);
+
+  for (int i = 0; i < N; i++) {
+    printf("%f ", A[i]);
+  }
+  printf("\nsum = %f, time = %f us\n", C[3] + C[4] + C[5] + C[6], t);
+
+  return 0;
+}
@@ -0,0 +1,73 @@
+import argparse
+import re
+import sys
+
+######################### DO NOT TOUCH #########################
+CHECK_RE = re.compile(r"^;\s*(CHECK|CHECK-NOT):\s*(.*?)\s*$")
+######################### DO NOT TOUCH #########################
+
+
+"""
+Match the IR the Makefile produced for a kernel against its checks, like a
+small FileCheck. Every "; CHECK: <regex>" line of the check file must match a
+line of the IR after the one the previous CHECK matched, and no
+"; CHECK-NOT: <regex>" may match a line in between. Returns the errors.
+"""
+def check(ll_path, check_path):
+	lines = open(ll_path).read().splitlines()
+	errors = []
+	pos = 0
+	nots = []
+	for number, line in enumerate(open(check_path), 1):
+		match = CHECK_RE.match(line)
+		if (not match):
+			continue
+		kind, regex = match.group(1), re.compile(match.group(2))
+		if (kind == "CHECK-NOT"):
+			nots.append((number, regex))
+			continue
+
+		end = next((i for i in range(pos, len(lines))
+					if regex.search(lines[i])), None)
+		if (end is None):
+			errors.append("{}:{}: no match for \"{}\" after line {} of {}"
+						  .format(check_path, number, regex.pattern, pos,
+								  ll_path))
+			return errors
+		for not_number, not_regex in nots:
+			errors += not_found(lines, pos, end, not_regex, check_path,
+								not_number, ll_path)
+		nots = []
+		pos = end + 1
+
+	for not_number, not_regex in nots:
+		errors += not_found(lines, pos, len(lines), not_regex, check_path,
+							not_number, ll_path)
+	return errors
+
+def not_found(lines, start, end, regex, check_path, number, ll_path):
+	return ["{}:{}: \"{}\" matches line {} of {}"
+			.format(check_path, number, regex.pattern, i + 1, ll_path)
+			for i in range(start, end) if regex.search(lines[i])]
+
+def parse_args():
+	parser = argparse.ArgumentParser(
+		description="Match IR files against check files, e.g. "
+					"mmm/mmm.unroll.ll against mmm/mmm.unroll.check")
+	parser.add_argument("checks", nargs="+",
+						help="check files, each next to the .ll file it "
+							 "checks")
+	return parser.parse_args()
+
+
+if __name__ == "__main__":
+	args = parse_args()
+
+	errors = []
+	for check_path in args.checks:
+		ll_path = re.sub(r"\.check$", ".ll", check_path)
+		errors += check(ll_path, check_path)
+
+	for error in errors:
+		print(error)
+	sys.exit(1 if errors else 0)
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <time.h>
+
+/*----------------------------------------------------------------------------
+ * Internal Definitions
+ *----------------------------------------------------------------------------*/
+
+#define MSIZE 128
+
+// The matrices used for matrix multiplication
+double A[MSIZE][MSIZE];
+double B[MSIZE][MSIZE];
+double C[MSIZE][MSIZE];
+
+/*----------------------------------------------------------------------------
+ * Functions
+ *----------------------------------------------------------------------------*/
+
+static void init() {
+  int i, j;
+  for (i = 0; i < MSIZE; i++) {
+    for (j = 0; j < MSIZE; j++) {
+      A[i][j] = i * MSIZE + j;
+      B[i][j] = ((i + 1) << 16) + (j + 1);
+      C[i][j] = 0;
+    }
+  }
+}
+
+/* Accumulates the product of A and B into C. The matrices are the globals
+ * themselves, which cannot overlap, so the columns of C can be jammed into
+ * the inner loop, each summed in its own register. */
+void gemm() {
+  int i, j, k;
+
+  for (i = 0; i < MSIZE; i++) {
+    for (j = 0; j < MSIZE; j++) {
+      for (k = 0; k < MSIZE; k++) {
+        C[i][j] += A[i][k] * B[k][j];
+      }
+    }
+  }
+}
+
+// Sums all the elements in C together
+double reduce() {
+  double sum = 0;
+  int i, j;
+
+  for (i = 0; i < MSIZE; i++) {
+    for (j = 0; j < MSIZE; j++) {
+      sum += C[i][j];
+    }
+  }
+
+  return sum;
+}
+
+// Main method for the program
+int main() {
+
+  init();
+
+  clock_t start, end;
+  double t;
+
+  start = clock();
+  gemm();
+  end = clock();
+  t = ((double)(end - start)) / CLOCKS_PER_SEC * 1e6;
+
+  double sum = reduce();
+  printf("sum = %f, time = %f\n", sum, t);
+  return 0;
+}
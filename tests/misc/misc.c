@@ -1,7 +1,12 @@
+#include <math.h>
+
 #define N 16
 int A[N];
 int B[N];
 int C[N];
+float D[N];
+float E[N];
+float F[N];
 
 int test1(int a, int b, int c, int d) {
   // should be parallelizable into a vector add
@@ -83,6 +88,31 @@ int test6(int a, int b, int c, int d, long i) {
   return 0;
 }
 
+int test7(long i) {
+  // six lanes of floats are more than a vector register holds: a vector add
+  // of four lanes and one of two
+  // bitcast(F[i:i+4]) = bitcast(D[i:i+4]) + bitcast(E[i:i+4])
+  // bitcast(F[i+4:i+6]) = bitcast(D[i+4:i+6]) + bitcast(E[i+4:i+6])
+  F[i]      = D[i] + E[i];
+  F[i + 1]  = D[i + 1] + E[i + 1];
+  F[i + 2]  = D[i + 2] + E[i + 2];
+  F[i + 3]  = D[i + 3] + E[i + 3];
+  F[i + 4]  = D[i + 4] + E[i + 4];
+  F[i + 5]  = D[i + 5] + E[i + 5];
+  return 0;
+}
+
+int test8(long i) {
+  // lroundf has no vector form, so the tree is cut at it: a vector multiply,
+  // scalar lroundf of its lanes and a vector add of the results
+  // bitcast(C[i:i+4]) = <lroundf(D[i]*2), ...> + <1, 1, 1, 1>
+  C[i]      = (int)lroundf(D[i] * 2) + 1;
+  C[i + 1]  = (int)lroundf(D[i + 1] * 2) + 1;
+  C[i + 2]  = (int)lroundf(D[i + 2] * 2) + 1;
+  C[i + 3]  = (int)lroundf(D[i + 3] * 2) + 1;
+  return 0;
+}
+
 int main() {
   for (int i=0; i < N; i++) A[i] = i;
   printf("test1: %d\n", test1(1, 2, 3, 4));
@@ -91,5 +121,7 @@ int main() {
   printf("test4: %d\n", test4(1, 2, 3, 4, 0));
   printf("test5: %d\n", test5(0));
   printf("test6: %d\n", test6(1, 2, 3, 4, 0));
+  printf("test7: %d\n", test7(0));
+  printf("test8: %d\n", test8(0));
   return 0;
 }
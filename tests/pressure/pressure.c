@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <time.h>
+
+#define N (1 << 16)
+#define K 36
+
+static float A[K][N], Y[N];
+
+void set() {
+  for (long k = 0; k < K; k++) {
+    for (long i = 0; i < N; i++) {
+      A[k][i] = (float)((k + i) % 7);
+    }
+  }
+}
+
+// Every stream is loaded before the first product, so once the loop is
+// unrolled the 36 loaded vectors are live at once, more than the vector
+// registers of the target: some load packs are dropped to fit, the others
+// are still vectorized
+void streams(float (*A)[N], float *Y) {
+  for (long i = 0; i < N; i++) {
+    float a0 = A[0][i];
+    float a1 = A[1][i];
+    float a2 = A[2][i];
+    float a3 = A[3][i];
+    float a4 = A[4][i];
+    float a5 = A[5][i];
+    float a6 = A[6][i];
+    float a7 = A[7][i];
+    float a8 = A[8][i];
+    float a9 = A[9][i];
+    float a10 = A[10][i];
+    float a11 = A[11][i];
+    float a12 = A[12][i];
+    float a13 = A[13][i];
+    float a14 = A[14][i];
+    float a15 = A[15][i];
+    float a16 = A[16][i];
+    float a17 = A[17][i];
+    float a18 = A[18][i];
+    float a19 = A[19][i];
+    float a20 = A[20][i];
+    float a21 = A[21][i];
+    float a22 = A[22][i];
+    float a23 = A[23][i];
+    float a24 = A[24][i];
+    float a25 = A[25][i];
+    float a26 = A[26][i];
+    float a27 = A[27][i];
+    float a28 = A[28][i];
+    float a29 = A[29][i];
+    float a30 = A[30][i];
+    float a31 = A[31][i];
+    float a32 = A[32][i];
+    float a33 = A[33][i];
+    float a34 = A[34][i];
+    float a35 = A[35][i];
+    Y[i] = a0 * a35 +
+           a1 * a34 +
+           a2 * a33 +
+           a3 * a32 +
+           a4 * a31 +
+           a5 * a30 +
+           a6 * a29 +
+           a7 * a28 +
+           a8 * a27 +
+           a9 * a26 +
+           a10 * a25 +
+           a11 * a24 +
+           a12 * a23 +
+           a13 * a22 +
+           a14 * a21 +
+           a15 * a20 +
+           a16 * a19 +
+           a17 * a18;
+  }
+}
+
+float sum() {
+  float sum = 0;
+  for (long i = 0; i < N; i++) {
+    sum += Y[i];
+  }
+  return sum;
+}
+
+int main() {
+  set();
+
+  clock_t start, end;
+  start = clock();
+  streams(A, Y);
+  end = clock();
+  double t = ((double)(end - start)) / CLOCKS_PER_SEC * 1e6;
+
+  float s = sum();
+  printf("sum = %f, time = %f us\n", s, t);
+
+  return 0;
+}
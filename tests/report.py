@@ -0,0 +1,270 @@
+import argparse
+import json
+import os
+import re
+import subprocess
+
+######################### USER DEFINED #########################
+TESTS = ["alias",
+		 "axpy",
+		 "arithmetic",
+		 "dotprod",
+		 "gemm",
+		 "memcpy",
+		 "mmm",
+		 "pressure"]
+
+# before and after the SLP pass, see the Makefile
+VARIANTS = ["unroll", "slp"]
+
+MTRIPLE = "aarch64-linux-gnu"
+MCPU = "cortex-a72"
+ITERATIONS = 100
+######################### USER DEFINED #########################
+
+
+######################### DO NOT TOUCH #########################
+TESTS_DIR = os.path.dirname(os.path.realpath(__file__))
+OUTPUT_DIR = os.path.join(TESTS_DIR, "output")
+
+DEFINE_RE = re.compile(r"^define .*@([\w.$]+)\(")
+VECTOR_TYPE_RE = re.compile(r"<\d+ x ")
+OPCODE_RE = re.compile(r"^\s+(?:%[\w.$-]+ = )?(\w+)")
+LABEL_RE = re.compile(r"^([\w.$-]+):")
+
+SHUFFLE_OPS = {"insertelement", "extractelement", "shufflevector"}
+# statements the pass may pack, everything else is control or addressing
+PACKABLE_OPS = {"add", "fadd", "sub", "fsub", "mul", "fmul", "udiv", "sdiv",
+				"fdiv", "urem", "srem", "frem", "shl", "lshr", "ashr", "and",
+				"or", "xor", "fneg", "load", "store", "call"}
+
+ASM_FUNC_RE = re.compile(r"^([\w.$]+):")
+ASM_BLOCK_RE = re.compile(r"^(?:\.LBB\w+:|\s*(?://|#) %bb\.\d+:)\s*(?://|#) (%\S+)")
+ASM_LOOP_RE = re.compile(r"(?://|#).*(?:in Loop:|Loop Header:).*Depth=(\d+)")
+ASM_FUNC_END_RE = re.compile(r"^\.Lfunc_end|^\s*\.cfi_endproc")
+######################### DO NOT TOUCH #########################
+
+
+"""
+report = {
+	test1: {
+		function1: {
+			unroll: {
+				vector: x,
+				shuffle: x,
+				scalar: x,
+				region: "loop" or "function",
+				cycles_per_iter: x,
+				block_rthroughput: x
+			},
+			slp: ...
+		},
+		function2: ...
+	},
+	test2: ...
+}
+"""
+# Count the vector, insert/extract/shuffle and scalar statements of every
+# function in the IR file, except in the scalar fallback of alias checks
+def count_ir(ll_path):
+	counts = dict()
+	func = None
+	fallback = False
+	for line in open(ll_path):
+		match = LABEL_RE.match(line)
+		if (match):
+			fallback = match.group(1).endswith(".scalar")
+			continue
+		match = DEFINE_RE.match(line)
+		if (match):
+			func = match.group(1)
+			fallback = False
+			counts[func] = {"vector": 0, "shuffle": 0, "scalar": 0}
+			continue
+		if (line.startswith("}")):
+			func = None
+			continue
+		if (func is None or fallback):
+			continue
+
+		match = OPCODE_RE.match(line)
+		if (not match):
+			continue
+		opcode = match.group(1)
+		if (opcode in SHUFFLE_OPS):
+			counts[func]["shuffle"] += 1
+		elif (opcode in PACKABLE_OPS):
+			if (opcode == "call" and "@llvm." not in line):
+				continue
+			if (VECTOR_TYPE_RE.search(line)):
+				counts[func]["vector"] += 1
+			else:
+				counts[func]["scalar"] += 1
+
+	return counts
+
+def compile_asm(ll_path, args):
+	llc_cmd = ["llc",
+			   "-O2",
+			   "-mtriple={}".format(args.mtriple),
+			   "-mcpu={}".format(args.mcpu),
+			   ll_path,
+			   "-o", "-"]
+	proc = subprocess.run(llc_cmd, capture_output=True, text=True)
+	if (proc.returncode != 0):
+		print(proc.stderr)
+		return None
+	return proc.stdout
+
+"""
+Split the assembly into the hot region of every function: the blocks of its
+innermost loops, leaving out the scalar fallback blocks of runtime alias
+checks, or the whole function when it has no loop
+"""
+def hot_regions(asm):
+	regions = dict()
+	func = None
+	blocks = []
+	for line in asm.splitlines():
+		match = ASM_FUNC_RE.match(line)
+		if (match and not line.startswith(".")):
+			func = match.group(1)
+			blocks = [{"name": "%entry", "depth": 0, "code": []}]
+			continue
+		if (func is None):
+			continue
+
+		if (ASM_FUNC_END_RE.match(line)):
+			depth = max(block["depth"] for block in blocks)
+			code = [instr for block in blocks
+					if block["depth"] == depth and
+					not block["name"].endswith(".scalar")
+					for instr in block["code"]]
+			regions[func] = ("loop" if depth > 0 else "function", code)
+			func = None
+			continue
+
+		match = ASM_BLOCK_RE.match(line)
+		if (match):
+			blocks.append({"name": match.group(1), "depth": 0, "code": []})
+			continue
+		match = ASM_LOOP_RE.search(line)
+		if (match):
+			blocks[-1]["depth"] = int(match.group(1))
+			continue
+
+		instr = re.split(r"\s(?://|#)", line)[0].strip()
+		if (instr and not instr.startswith((".", "//", "#")) and
+				not instr.endswith(":")):
+			blocks[-1]["code"].append(instr)
+
+	return regions
+
+def run_mca(code, args):
+	if (not code):
+		return None, None
+
+	mca_cmd = ["llvm-mca",
+			   "-mtriple={}".format(args.mtriple),
+			   "-mcpu={}".format(args.mcpu),
+			   "-iterations={}".format(args.iterations)]
+	proc = subprocess.run(mca_cmd, input="\n".join(code) + "\n",
+						  capture_output=True, text=True)
+	if (proc.returncode != 0):
+		print(proc.stderr)
+		return None, None
+
+	stats = dict()
+	for line in proc.stdout.splitlines():
+		if (":" in line):
+			key, _, value = line.partition(":")
+			stats[key.strip()] = value.strip()
+
+	cycles = int(stats["Total Cycles"]) / int(stats["Iterations"])
+	return round(cycles, 2), float(stats["Block RThroughput"])
+
+def report_test(test_name, report, args):
+	report[test_name] = dict()
+	for variant in args.variants:
+		ll_path = os.path.join(TESTS_DIR, test_name,
+							   "{}.{}.ll".format(test_name, variant))
+		if (not os.path.exists(ll_path)):
+			print("missing {}, run make TEST={} first".format(ll_path,
+															   test_name))
+			continue
+
+		counts = count_ir(ll_path)
+		asm = compile_asm(ll_path, args)
+		regions = hot_regions(asm) if asm else dict()
+
+		for func, stats in counts.items():
+			region, code = regions.get(func, ("function", []))
+			cycles, rthroughput = run_mca(code, args)
+			stats["region"] = region
+			stats["cycles_per_iter"] = cycles
+			stats["block_rthroughput"] = rthroughput
+			report[test_name].setdefault(func, dict())[variant] = stats
+
+# One line per function and variant, so that two reports diff line by line
+def format_report(report, args):
+	lines = ["# mtriple={} mcpu={} iterations={}".format(
+				args.mtriple, args.mcpu, args.iterations),
+			 "{:<12} {:<16} {:<8} {:<8} {:>6} {:>7} {:>6} {:>12} {:>11}".format(
+				"test", "function", "variant", "region", "vector", "shuffle",
+				"scalar", "cycles/iter", "rthroughput")]
+
+	for test in sorted(report):
+		for func in sorted(report[test]):
+			for variant in args.variants:
+				stats = report[test][func].get(variant)
+				if (stats is None):
+					continue
+				lines.append(
+					"{:<12} {:<16} {:<8} {:<8} {:>6} {:>7} {:>6} {:>12} {:>11}"
+					.format(test, func, variant, stats["region"],
+							stats["vector"], stats["shuffle"], stats["scalar"],
+							"-" if stats["cycles_per_iter"] is None
+							else "{:.2f}".format(stats["cycles_per_iter"]),
+							"-" if stats["block_rthroughput"] is None
+							else "{:.2f}".format(stats["block_rthroughput"])))
+
+	return "\n".join(lines) + "\n"
+
+def parse_args():
+	parser = argparse.ArgumentParser(
+		description="Count the vector, shuffle and scalar statements of every "
+					"kernel before and after SLP, and estimate the cycles "
+					"per iteration of its hot loop with llvm-mca")
+	parser.add_argument("tests", nargs="*", default=TESTS,
+						help="kernels to report (default: %(default)s)")
+	parser.add_argument("--variants", nargs="+", default=VARIANTS,
+						help="IR variants to compare (default: %(default)s)")
+	parser.add_argument("--mtriple", default=MTRIPLE,
+						help="target triple (default: %(default)s)")
+	parser.add_argument("--mcpu", default=MCPU,
+						help="CPU model of llvm-mca (default: %(default)s)")
+	parser.add_argument("--iterations", type=int, default=ITERATIONS,
+						help="llvm-mca iterations (default: %(default)s)")
+	parser.add_argument("--out", default=os.path.join(OUTPUT_DIR, "report"),
+						help="writes OUT.txt and OUT.json "
+							 "(default: %(default)s)")
+	return parser.parse_args()
+
+
+if __name__ == "__main__":
+	args = parse_args()
+
+	report = dict()
+	for test in args.tests:
+		report_test(test, report, args)
+
+	text = format_report(report, args)
+	os.makedirs(os.path.dirname(os.path.abspath(args.out)), exist_ok=True)
+	with open(args.out + ".txt", "w") as f:
+		f.write(text)
+	with open(args.out + ".json", "w") as f:
+		json.dump(report, f, indent=4, sort_keys=True)
+
+	print(text, end="")
+	print()
+	print("report written to {}.txt and {}.json".format(args.out, args.out))
@@ -1,63 +1,93 @@
+import argparse
+import json
 import os
+import platform
+import re
+import shutil
+import statistics
 import subprocess
+import sys
+import time
 
 ######################### USER DEFINED #########################
-TESTS = ["axpy", 
-		 "arithmetic", 
+TESTS = ["alias",
+		 "axpy",
+		 "arithmetic",
 		 "dotprod",
+		 "gemm",
 		 "memcpy",
-		 "mmm"]
+		 "mmm",
+		 "pressure"]
 
-TEST_TYPES = ["O1",
-			  "O1_w_slp",
-			  "O2"]
+# variant name -> suffix of the executable built by the Makefile
+TEST_TYPES = {"O1": "1",
+			  "O1_w_unroll": "unroll",
+			  "O1_w_slp": "slp",
+			  "O1_w_llvm_slp": "llvmslp",
+			  "O2": "2"}
 
-GEM5_DIR = "/compiler/15745/gem5"
+TRIALS = 5
+
+# relative tolerance when comparing the numbers printed by each variant,
+# since -ffast-math lets reductions be reassociated
+RTOL = 1e-4
+
+QEMU = ["qemu-aarch64", "-L", "/usr/aarch64-linux-gnu"]
 ######################### USER DEFINED #########################
 
 
 ######################### DO NOT TOUCH #########################
 TESTS_DIR = os.path.dirname(os.path.realpath(__file__))
+OUTPUT_DIR = os.path.join(TESTS_DIR, "output")
 FAIL = -1
 SUCCESS = 0
+
+# every kernel prints "time = <microseconds>" around its hot code, most of
+# them followed by " us"
+TIME_RE = re.compile(r"time = ([-+0-9.eE]+)(?: us)?")
+NUMBER_RE = re.compile(r"^[-+]?(\d+\.?\d*|\.\d+)([eE][-+]?\d+)?$")
 ######################### DO NOT TOUCH #########################
 
 
 """
-stats_dit = {
+stats_dict = {
 	test1: {
 		O1: {
-			tick_count: x,
-			code_size: x
+			times: [x, ...],
+			median: x,
+			variance: x,
+			code_size: x,
+			output_ok: True
 		},
-		O1_w_slp: {
-			tick_count: x,
-			code_size: x
-		},
-		O2: {
-			tick_count: x,
-			code_size: x
-		}		
+		O1_w_slp: ...
 	},
 	test2: ...
 }
 """
-def create_stats_dict():
+def create_stats_dict(tests, test_types):
 	stats_dict = dict()
-	for test in TESTS:
+	for test in tests:
 		stats_dict[test] = dict()
-		for test_type in TEST_TYPES:
-			stats_dict[test][test_type] = {"tick_count": 0, "code_size": 0}
+		for test_type in test_types:
+			stats_dict[test][test_type] = {"times": [],
+										   "median": None,
+										   "variance": None,
+										   "code_size": None,
+										   "output_ok": None}
 
 	return stats_dict
 
-def make_test(test_name):
-	print("running make...", end=" ")
+def make_test(test_name, native):
+	print("running make...", end=" ", flush=True)
 
-	make_cmd = ["make", 
-				"all", 
-				"TEST={}".format(test_name)]
-	proc = subprocess.run(make_cmd)
+	make_cmd = ["make",
+				"all",
+				"check",
+				"cache",
+				"TEST={}".format(test_name),
+				"NATIVE={}".format(1 if native else 0)]
+	proc = subprocess.run(make_cmd, cwd=TESTS_DIR,
+						  stdout=subprocess.DEVNULL)
 
 	if (proc.returncode != 0):
 		print("FAIL")
@@ -68,88 +98,174 @@ def make_test(test_name):
 		print("="*25)
 		return SUCCESS
 
-def get_text_exec_path(test_name, test_type):
-	text_exec = None
-	if (test_type == "O1"):
-		test_exec = test_name + ".1.out"
-	elif (test_type == "O1_w_slp"):
-		test_exec = test_name + ".slp.out"
-	elif (test_type == "O2"):
-		test_exec = test_name + ".2.out"
-	else:
+def get_test_exec_path(test_name, test_type):
+	if (test_type not in TEST_TYPES):
 		print("Invalid test type")
 		assert False
 
-	return os.path.join(TESTS_DIR, test_name, test_type)
+	test_exec = "{}.{}.out".format(test_name, TEST_TYPES[test_type])
+	return os.path.join(OUTPUT_DIR, test_name, test_exec)
+
+# Run natively when the executables target the host, under qemu otherwise
+def get_run_cmd(test_exec_path, native):
+	if (native or platform.machine() in ("aarch64", "arm64")):
+		return [test_exec_path]
+	return QEMU + [test_exec_path]
+
+# Size of the text section, or of the whole executable without llvm-size
+def get_code_size(test_exec_path):
+	if (shutil.which("llvm-size")):
+		proc = subprocess.run(["llvm-size", test_exec_path],
+							  capture_output=True, text=True)
+		if (proc.returncode == 0):
+			return int(proc.stdout.splitlines()[1].split()[0])
+	return os.path.getsize(test_exec_path)
+
+# Run one trial, return its output without the timing and the time in us
+def run_trial(test_name, test_type, native):
+	test_exec_path = get_test_exec_path(test_name, test_type)
+	start = time.perf_counter()
+	proc = subprocess.run(get_run_cmd(test_exec_path, native),
+						  capture_output=True, text=True)
+	wall = (time.perf_counter() - start) * 1e6
 
-def run_gem5(test_name, test_type):
-	print("\trunning gem5...", end="")
-
-	test_exec_path = get_text_exec_path(test_name, test_type)
-	gem5_opt_path = os.path.join(GEM5_DIR, "build/ARM/gem5.opt")
-	gem5_config_path = os.path.join(GEM5_DIR, "configs/example/se.py")
-	gem5_cmd = [gem5_opt_path,
-				gem5_config_path,
-				"--cpu-type O3_ARM_v7a_3",
-				"--caches",
-				"--l2cache",
-				"--cmd", test_exec_path,
-				"--mem-size=8GB"]
-
-	proc = subprocess.run(gem5_cmd)
 	if (proc.returncode != 0):
-		print("FAIL")
-		print("\t" + "="*25)
-		return FAIL
-	else:
-		print("SUCCESS")
-		print("\t" + "="*25)
-		return SUCCESS
-
-def get_stats(test_name, test_type, stats_dict):
-	# tick count
-	stats_txt_path = os.path.join(TESTS_DIR, "m5_out", "stats.txt")
-	tick_count = open(stats_txt_path, "r").readlines()[1].split()[1]
-
-	# code size
-	test_exec_path = get_text_exec_path(test_name, test_type)
-	code_size = os.path.getsize(test_exec_path)
-
-	# update stats dict
-	stats_dict[test_name][test_type]["tick_count"] = tick_count
-	stats_dict[test_name][test_type]["code_size"] = code_size
-
-
-def run_test(test_name, stats_dict):
+		return None, None
+
+	match = TIME_RE.search(proc.stdout)
+	t = float(match.group(1)) if match else wall
+	return TIME_RE.sub("time = <t>", proc.stdout), t
+
+def same_output(out, ref, rtol):
+	tokens = out.replace(",", " ").split()
+	ref_tokens = ref.replace(",", " ").split()
+	if (len(tokens) != len(ref_tokens)):
+		return False
+
+	for token, ref_token in zip(tokens, ref_tokens):
+		if (NUMBER_RE.match(token) and NUMBER_RE.match(ref_token)):
+			x, y = float(token), float(ref_token)
+			if (abs(x - y) > rtol * max(abs(x), abs(y), 1.0)):
+				return False
+		elif (token != ref_token):
+			return False
+
+	return True
+
+def run_variant(test_name, test_type, stats_dict, args):
+	print("\trunning {} trials...".format(args.trials), end=" ", flush=True)
+
+	stats = stats_dict[test_name][test_type]
+	output = None
+	for _ in range(args.trials):
+		out, t = run_trial(test_name, test_type, args.native)
+		if (out is None):
+			print("FAIL")
+			print("\t" + "="*25)
+			return FAIL, None
+		output = out
+		stats["times"].append(t)
+
+	stats["median"] = statistics.median(stats["times"])
+	stats["variance"] = statistics.pvariance(stats["times"])
+	stats["code_size"] = get_code_size(get_test_exec_path(test_name, test_type))
+
+	print("SUCCESS")
+	print("\t" + "="*25)
+	return SUCCESS, output
+
+def run_test(test_name, stats_dict, args):
 	print()
 	print("TEST={}".format(test_name))
 	print("="*50)
 	print()
 
-	if (make_test(test_name) != SUCCESS):
+	if (make_test(test_name, args.native) != SUCCESS):
 		return
 
 	print()
 
-	for test_type in test_types:
+	# the first variant is the reference output
+	ref = None
+	for test_type in args.types:
 		print(test_type)
 		print("="*25)
 
-		if (run_gem5(test_name, test_type) == SUCCESS):
-			get_stats(test_name, test_type, stats_dict)
+		status, output = run_variant(test_name, test_type, stats_dict, args)
+		if (status == SUCCESS):
+			if (ref is None):
+				ref = output
+			ok = same_output(output, ref, args.rtol)
+			stats_dict[test_name][test_type]["output_ok"] = ok
+			if (not ok):
+				print("\toutput differs from {}:".format(args.types[0]))
+				print("\t" + output.strip())
 
 		print()
 
 	print("="*50)
 	print()
 
+def print_table(stats_dict, types):
+	header = "{:<12} {:<14} {:>14} {:>14} {:>10} {:>8} {:>7}".format(
+		"test", "variant", "median (us)", "variance", "size (B)",
+		"speedup", "output")
+	print(header)
+	print("-"*len(header))
+
+	for test, variants in stats_dict.items():
+		base = variants[types[0]]["median"]
+		for test_type in types:
+			stats = variants[test_type]
+			if (stats["median"] is None):
+				print("{:<12} {:<14} {:>14}".format(test, test_type, "FAIL"))
+				continue
+			speedup = base / stats["median"] if base and stats["median"] else 0
+			print("{:<12} {:<14} {:>14.1f} {:>14.1f} {:>10} {:>7.2f}x {:>7}"
+				  .format(test, test_type, stats["median"], stats["variance"],
+						  stats["code_size"], speedup,
+						  "ok" if stats["output_ok"] else "DIFF"))
+
+def parse_args():
+	parser = argparse.ArgumentParser(
+		description="Build every kernel for each variant, run it repeatedly "
+					"and compare times, code sizes and outputs")
+	parser.add_argument("tests", nargs="*", default=TESTS,
+						help="kernels to run (default: %(default)s)")
+	parser.add_argument("--types", nargs="+", default=list(TEST_TYPES),
+						choices=list(TEST_TYPES),
+						help="variants to run, the first one is the "
+							 "reference (default: %(default)s)")
+	parser.add_argument("--trials", type=int, default=TRIALS,
+						help="runs of each variant (default: %(default)s)")
+	parser.add_argument("--native", action="store_true",
+						help="build for and run on the host instead of "
+							 "aarch64")
+	parser.add_argument("--rtol", type=float, default=RTOL,
+						help="relative tolerance of printed numbers "
+							 "(default: %(default)s)")
+	parser.add_argument("--json", default=os.path.join(OUTPUT_DIR,
+													   "stats.json"),
+						help="where to write the results "
+							 "(default: %(default)s)")
+	return parser.parse_args()
+
 
 if __name__ == "__main__":
-	stats_dict = create_stats_dict()
-	for test in TESTS:
-		run_test(test, stats_dict)
+	args = parse_args()
 
-	print(stats_dict)
+	stats_dict = create_stats_dict(args.tests, args.types)
+	for test in args.tests:
+		run_test(test, stats_dict, args)
 
+	os.makedirs(os.path.dirname(os.path.abspath(args.json)), exist_ok=True)
+	with open(args.json, "w") as f:
+		json.dump(stats_dict, f, indent=4)
 
+	print_table(stats_dict, args.types)
+	print()
+	print("results written to {}".format(args.json))
 
+	failed = [stats for variants in stats_dict.values()
+			  for stats in variants.values() if not stats["output_ok"]]
+	sys.exit(1 if failed else 0)